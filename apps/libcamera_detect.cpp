@@ -9,6 +9,7 @@
 
 #include <chrono>
 
+#include "core/buffer_sync.hpp"
 #include "core/libcamera_app.hpp"
 #include "core/still_options.hpp"
 
@@ -97,7 +98,8 @@ static void event_loop(LibcameraDetectApp &app)
 
 			StreamInfo info;
 			libcamera::Stream *stream = app.StillStream(&info);
-			const std::vector<libcamera::Span<uint8_t>> mem = app.Mmap(completed_request->buffers[stream]);
+			BufferReadSync r(&app, completed_request->buffers[stream], true);
+			const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
 
 			// Make a filename for the output and save it.
 			char filename[128];
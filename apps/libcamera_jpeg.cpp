@@ -7,6 +7,7 @@
 
 #include <chrono>
 
+#include "core/buffer_sync.hpp"
 #include "core/libcamera_app.hpp"
 #include "core/still_options.hpp"
 
@@ -54,7 +55,14 @@ static void event_loop(LibcameraJpegApp &app)
 			auto now = std::chrono::high_resolution_clock::now();
 			if (options->timeout && now - start_time > std::chrono::milliseconds(options->timeout))
 			{
+				CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
 				app.StopCamera();
+				if (options->carry_exposure)
+				{
+					libcamera::ControlList controls =
+						app.CarryControls(completed_request->metadata, options->carry_exposure);
+					app.SetControls(controls);
+				}
 				app.Teardown();
 				app.ConfigureStill();
 				app.StartCamera();
@@ -74,7 +82,8 @@ static void event_loop(LibcameraJpegApp &app)
 			Stream *stream = app.StillStream();
 			StreamInfo info = app.GetStreamInfo(stream);
 			CompletedRequestPtr &payload = std::get<CompletedRequestPtr>(msg.payload);
-			const std::vector<libcamera::Span<uint8_t>> mem = app.Mmap(payload->buffers[stream]);
+			BufferReadSync r(&app, payload->buffers[stream], true);
+			const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
 			jpeg_save(mem, info, payload->metadata, options->output, app.CameraId(), options);
 			return;
 		}
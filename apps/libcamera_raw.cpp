@@ -19,8 +19,8 @@ public:
 	LibcameraRaw() : LibcameraEncoder() {}
 
 protected:
-	// Force the use of "null" encoder.
-	void createEncoder() { encoder_ = std::unique_ptr<Encoder>(new NullEncoder(GetOptions())); }
+	// Force the use of "null" encoder, which writes out the raw stream.
+	void createEncoder() override { addEncoder("video", RawStream(), new NullEncoder(GetOptions())); }
 };
 
 // The main even loop for the application.
@@ -10,8 +10,13 @@
 #include <sys/signalfd.h>
 #include <sys/stat.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <deque>
 
+#include "core/buffer_sync.hpp"
+#include "core/command_socket.hpp"
 #include "core/libcamera_app.hpp"
 #include "core/still_options.hpp"
 
@@ -71,18 +76,19 @@ static void update_latest_link(std::string const &filename, StillOptions const *
 }
 
 static void save_image(LibcameraStillApp &app, CompletedRequestPtr &payload, Stream *stream,
-					   std::string const &filename)
+					   std::string const &filename, std::string const &encoding)
 {
 	StillOptions const *options = app.GetOptions();
 	StreamInfo info = app.GetStreamInfo(stream);
-	const std::vector<libcamera::Span<uint8_t>> mem = app.Mmap(payload->buffers[stream]);
+	BufferReadSync r(&app, payload->buffers[stream], true);
+	const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
 	if (stream == app.RawStream())
 		dng_save(mem, info, payload->metadata, filename, app.CameraId(), options);
-	else if (options->encoding == "jpg")
+	else if (encoding == "jpg")
 		jpeg_save(mem, info, payload->metadata, filename, app.CameraId(), options);
-	else if (options->encoding == "png")
+	else if (encoding == "png")
 		png_save(mem, info, filename, options);
-	else if (options->encoding == "bmp")
+	else if (encoding == "bmp")
 		bmp_save(mem, info, filename, options);
 	else
 		yuv_save(mem, info, filename, options);
@@ -90,22 +96,55 @@ static void save_image(LibcameraStillApp &app, CompletedRequestPtr &payload, Str
 		std::cerr << "Saved image " << info.width << " x " << info.height << " to file " << filename << std::endl;
 }
 
-static void save_images(LibcameraStillApp &app, CompletedRequestPtr &payload)
+static void save_images(LibcameraStillApp &app, CompletedRequestPtr &payload, std::string filename,
+						std::string const &encoding)
 {
 	StillOptions *options = app.GetOptions();
-	std::string filename = generate_filename(options);
-	save_image(app, payload, app.StillStream(), filename);
+	save_image(app, payload, app.StillStream(), filename, encoding);
 	update_latest_link(filename, options);
 	if (options->raw)
 	{
 		filename = filename.substr(0, filename.rfind('.')) + ".dng";
-		save_image(app, payload, app.RawStream(), filename);
+		save_image(app, payload, app.RawStream(), filename, encoding);
 	}
+}
+
+static void next_frame_number(StillOptions *options)
+{
 	options->framestart++;
 	if (options->wrap)
 		options->framestart %= options->wrap;
 }
 
+// Make one set of controls per bracket entry, with the exposure time scaled from
+// the viewfinder's (or the user's fixed) exposure.
+static std::vector<libcamera::ControlList> make_brackets(libcamera::ControlList const &metadata,
+														StillOptions const *options)
+{
+	using namespace libcamera;
+	float exposure = options->shutter;
+	if (!exposure && metadata.contains(controls::ExposureTime))
+		exposure = metadata.get(controls::ExposureTime) * (options->carry_exposure ? options->carry_exposure : 1.0);
+	float gain = options->gain;
+	if (!gain && metadata.contains(controls::AnalogueGain))
+		gain = metadata.get(controls::AnalogueGain);
+	if (!exposure || !gain)
+		throw std::runtime_error("no exposure available to bracket from");
+
+	std::vector<ControlList> brackets;
+	for (float ev : options->bracket_ev)
+	{
+		ControlList controls(controls::controls);
+		controls.set(controls::ExposureTime, (int32_t)(exposure * std::pow(2.0, ev)));
+		controls.set(controls::AnalogueGain, gain);
+		brackets.push_back(std::move(controls));
+		if (options->verbose)
+			std::cerr << "Bracket " << brackets.size() - 1 << ": EV " << ev << " exposure "
+					  << (int32_t)(exposure * std::pow(2.0, ev)) << " gain " << gain << std::endl;
+	}
+	return brackets;
+}
+
 // Some keypress/signal handling.
 
 static int signal_received;
@@ -139,20 +178,146 @@ static int get_key_or_signal(StillOptions const *options, pollfd p[1])
 	return key;
 }
 
+// Server mode. The camera runs continuously in the still configuration and each
+// command received on the socket saves one of the frames, for example
+// { "filename": "/tmp/a.jpg", "encoding": "jpg", "controls": { "ExposureTime": 20000 } }.
+// Captures are taken in turn. A capture's controls are only set once it's the next one
+// due, and it then waits a few frames for them to take effect.
+
+static constexpr unsigned int SERVER_SETTLE_FRAMES = 4;
+
+struct CaptureCommand
+{
+	int client;
+	std::string filename;
+	std::string encoding;
+	libcamera::ControlList controls;
+	bool started; // its controls have been set, and it's settling
+	unsigned int settle_frames;
+};
+
+// Only encodings matching the pixel format of the configured still stream can be saved.
+static bool encoding_supported(std::string const &encoding, unsigned int still_flags)
+{
+	if (still_flags & LibcameraApp::FLAG_STILL_BGR)
+		return encoding == "png" || encoding == "rgb";
+	else if (still_flags & LibcameraApp::FLAG_STILL_RGB)
+		return encoding == "bmp";
+	else
+		return encoding == "jpg" || encoding == "yuv420";
+}
+
+static void server_loop(LibcameraStillApp &app, unsigned int still_flags)
+{
+	StillOptions *options = app.GetOptions();
+	CommandSocket socket(options->server, options->verbose);
+	std::deque<CaptureCommand> captures;
+
+	app.OpenCamera();
+	app.ConfigureStill(still_flags | LibcameraApp::FLAG_STILL_DOUBLE_BUFFER);
+	app.StartCamera();
+	auto start_time = std::chrono::high_resolution_clock::now();
+
+	while (true)
+	{
+		LibcameraApp::Msg msg = app.Wait();
+		if (msg.type == LibcameraApp::MsgType::Quit)
+			return;
+		else if (msg.type != LibcameraApp::MsgType::RequestComplete)
+			throw std::runtime_error("unrecognised message!");
+
+		auto now = std::chrono::high_resolution_clock::now();
+		if (options->timeout && now - start_time > std::chrono::milliseconds(options->timeout))
+			return;
+
+		for (auto &command : socket.Poll())
+		{
+			try
+			{
+				if (command.params.get<bool>("quit", false))
+				{
+					for (auto const &capture : captures)
+						socket.ReplyError(capture.client, "server quit before capture");
+					boost::property_tree::ptree reply;
+					reply.put("status", "ok");
+					socket.Reply(command.client, reply);
+					return;
+				}
+
+				CaptureCommand capture = { command.client, "", "", libcamera::ControlList(), false, 0 };
+				capture.encoding = command.params.get<std::string>("encoding", options->encoding);
+				std::transform(capture.encoding.begin(), capture.encoding.end(), capture.encoding.begin(), ::tolower);
+				if (!encoding_supported(capture.encoding, still_flags))
+					throw std::runtime_error("encoding " + capture.encoding + " incompatible with server's --encoding");
+				capture.filename = command.params.get<std::string>("filename", "");
+				if (capture.filename.empty())
+				{
+					capture.filename = generate_filename(options);
+					next_frame_number(options);
+				}
+				if (capture.filename.empty())
+					throw std::runtime_error("no filename given and no default output");
+
+				auto controls_params = command.params.get_child_optional("controls");
+				if (controls_params)
+					capture.controls = CommandSocket::ParseControls(*controls_params);
+
+				captures.push_back(std::move(capture));
+			}
+			catch (std::exception const &e)
+			{
+				socket.ReplyError(command.client, e.what());
+			}
+		}
+
+		// Nobody wants the captures of clients that have gone (and there'd be no one to tell).
+		captures.erase(std::remove_if(captures.begin(), captures.end(),
+									  [&socket](CaptureCommand const &c) { return !socket.Connected(c.client); }),
+					   captures.end());
+		if (captures.empty())
+			continue;
+
+		CaptureCommand &next = captures.front();
+		if (!next.started)
+		{
+			next.started = true;
+			if (!next.controls.empty())
+			{
+				app.SetControls(next.controls);
+				next.settle_frames = SERVER_SETTLE_FRAMES;
+				continue;
+			}
+		}
+		if (next.settle_frames)
+		{
+			next.settle_frames--;
+			continue;
+		}
+
+		CaptureCommand capture = std::move(captures.front());
+		captures.pop_front();
+		try
+		{
+			save_images(app, std::get<CompletedRequestPtr>(msg.payload), capture.filename, capture.encoding);
+			boost::property_tree::ptree reply;
+			reply.put("status", "ok");
+			reply.put("filename", capture.filename);
+			socket.Reply(capture.client, reply);
+		}
+		catch (std::exception const &e)
+		{
+			socket.ReplyError(capture.client, e.what());
+		}
+	}
+}
+
 // The main even loop for the application.
 
-static void event_loop(LibcameraStillApp &app)
+static void event_loop(LibcameraStillApp &app, unsigned int still_flags)
 {
-	StillOptions const *options = app.GetOptions();
+	StillOptions *options = app.GetOptions();
 	bool output = !options->output.empty() || options->datetime || options->timestamp; // output requested?
 	bool keypress = options->keypress || options->signal; // "signal" mode is much like "keypress" mode
-	unsigned int still_flags = LibcameraApp::FLAG_STILL_NONE;
-	if (options->encoding == "rgb" || options->encoding == "png")
-		still_flags |= LibcameraApp::FLAG_STILL_BGR;
-	else if (options->encoding == "bmp")
-		still_flags |= LibcameraApp::FLAG_STILL_RGB;
-	if (options->raw)
-		still_flags |= LibcameraApp::FLAG_STILL_RAW;
 
 	app.OpenCamera();
 	if (options->immediate)
@@ -162,6 +327,8 @@ static void event_loop(LibcameraStillApp &app)
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
 	auto timelapse_time = start_time;
+	std::string bracket_filename;
+	unsigned int brackets_saved = 0;
 
 	// Monitoring for keypresses and signals.
 	signal(SIGUSR1, default_signal_handler);
@@ -202,8 +369,21 @@ static void event_loop(LibcameraStillApp &app)
 					return;
 				else
 				{
+					CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
 					timelapse_time = std::chrono::high_resolution_clock::now();
 					app.StopCamera();
+					if (options->carry_exposure || !options->bracket_ev.empty())
+					{
+						float scale = options->carry_exposure ? options->carry_exposure : 1.0;
+						libcamera::ControlList controls = app.CarryControls(completed_request->metadata, scale);
+						app.SetControls(controls);
+					}
+					if (!options->bracket_ev.empty())
+					{
+						app.SetBracketControls(make_brackets(completed_request->metadata, options));
+						bracket_filename = generate_filename(options);
+						brackets_saved = 0;
+					}
 					app.Teardown();
 					app.ConfigureStill(still_flags);
 					app.StartCamera();
@@ -219,9 +399,33 @@ static void event_loop(LibcameraStillApp &app)
 		// otherwise quit.
 		else if (app.StillStream())
 		{
-			app.StopCamera();
-			std::cerr << "Still capture image received" << std::endl;
-			save_images(app, std::get<CompletedRequestPtr>(msg.payload));
+			CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+			if (!options->bracket_ev.empty())
+			{
+				// Save each bracketed frame as it arrives, skipping any others.
+				unsigned int index;
+				if (completed_request->post_process_metadata.Get("bracket.index", index))
+					continue;
+				std::cerr << "Bracket image " << index << " received" << std::endl;
+				if (options->verbose)
+					std::cerr << "Bracket image " << index << ": exposure "
+							  << completed_request->metadata.get(libcamera::controls::ExposureTime) << " gain "
+							  << completed_request->metadata.get(libcamera::controls::AnalogueGain) << std::endl;
+				size_t dot = bracket_filename.rfind('.');
+				std::string filename = bracket_filename.substr(0, dot) + "_" + std::to_string(index) +
+									   (dot == std::string::npos ? "" : bracket_filename.substr(dot));
+				save_images(app, completed_request, filename, options->encoding);
+				if (++brackets_saved < options->bracket_ev.size())
+					continue;
+				app.StopCamera();
+			}
+			else
+			{
+				app.StopCamera();
+				std::cerr << "Still capture image received" << std::endl;
+				save_images(app, completed_request, generate_filename(options), options->encoding);
+			}
+			next_frame_number(options);
 			if (options->timelapse || options->signal || options->keypress)
 			{
 				app.Teardown();
@@ -245,7 +449,20 @@ int main(int argc, char *argv[])
 			if (options->verbose)
 				options->Print();
 
-			event_loop(app);
+			unsigned int still_flags = LibcameraApp::FLAG_STILL_NONE;
+			if (options->encoding == "rgb" || options->encoding == "png")
+				still_flags |= LibcameraApp::FLAG_STILL_BGR;
+			else if (options->encoding == "bmp")
+				still_flags |= LibcameraApp::FLAG_STILL_RGB;
+			if (options->raw)
+				still_flags |= LibcameraApp::FLAG_STILL_RAW;
+			if (!options->bracket_ev.empty())
+				still_flags |= LibcameraApp::FLAG_STILL_DOUBLE_BUFFER; // so bracket frames can follow back-to-back
+
+			if (!options->server.empty())
+				server_loop(app, still_flags);
+			else
+				event_loop(app, still_flags);
 		}
 	}
 	catch (std::exception const &e)
@@ -5,13 +5,16 @@
  * libcamera_vid.cpp - libcamera video record app.
  */
 
+#include <any>
 #include <chrono>
 #include <poll.h>
 #include <signal.h>
 #include <sys/signalfd.h>
 #include <sys/stat.h>
 
+#include "core/command_socket.hpp"
 #include "core/libcamera_encoder.hpp"
+#include "output/metadata_writer.hpp"
 #include "output/output.hpp"
 
 using namespace std::placeholders;
@@ -58,6 +61,115 @@ static int get_colourspace_flags(std::string const &codec)
 		return LibcameraEncoder::FLAG_VIDEO_NONE;
 }
 
+// Read the encode gate from the post-processing results. Any numeric result will do, with
+// non-zero meaning open. Returns false when there's no result, and throws if it isn't a number.
+
+static bool read_gate(Metadata const &metadata, std::string const &tag, bool &open)
+{
+	bool found = false;
+	metadata.ForEach([&](std::string const &name, std::any const &value) {
+		if (name != tag)
+			return;
+		if (auto v = std::any_cast<bool>(&value))
+			open = *v;
+		else if (auto v = std::any_cast<int>(&value))
+			open = *v != 0;
+		else if (auto v = std::any_cast<unsigned int>(&value))
+			open = *v != 0;
+		else if (auto v = std::any_cast<float>(&value))
+			open = *v != 0;
+		else if (auto v = std::any_cast<double>(&value))
+			open = *v != 0;
+		else
+			throw std::runtime_error("encode gate " + tag + " is not a boolean or a number");
+		found = true;
+	});
+	return found;
+}
+
+// Act on any commands from the control socket. Camera controls are gathered up and
+// all set together, so that they take effect on the same frame. Returns false when
+// told to quit.
+
+static bool handle_commands(LibcameraEncoder &app, CommandSocket &socket)
+{
+	libcamera::ControlList controls(libcamera::controls::controls);
+	bool quit = false;
+
+	for (auto &command : socket.Poll())
+	{
+		try
+		{
+			auto controls_params = command.params.get_child_optional("controls");
+			libcamera::ControlList new_controls(libcamera::controls::controls);
+			if (controls_params)
+				new_controls = CommandSocket::ParseControls(*controls_params);
+
+			auto roi_params = command.params.get_child_optional("roi");
+			if (roi_params)
+			{
+				std::vector<float> roi;
+				for (auto const &v : *roi_params)
+					roi.push_back(v.second.get_value<float>());
+				if (roi.size() != 4)
+					throw std::runtime_error("roi should be [ x, y, width, height ]");
+				new_controls.set(libcamera::controls::ScalerCrop, app.RoiToScalerCrop(roi[0], roi[1], roi[2], roi[3]));
+			}
+
+			auto stages_params = command.params.get_child_optional("stages");
+			if (stages_params)
+			{
+				for (auto const &stage : *stages_params)
+					app.EnablePostProcessingStage(stage.first, stage.second.get_value<bool>());
+			}
+
+			auto bitrate = command.params.get_optional<uint32_t>("bitrate");
+			if (bitrate)
+				app.SetBitrate(*bitrate);
+
+			if (command.params.get<bool>("keyframe", false))
+				app.RequestKeyframe();
+
+			// Later commands win over earlier ones.
+			new_controls.merge(controls);
+			controls = std::move(new_controls);
+
+			quit |= command.params.get<bool>("quit", false);
+
+			boost::property_tree::ptree reply;
+			reply.put("status", "ok");
+			// "stats" is either true, for the main encoder, or the name of an encoder.
+			std::string stats_name = command.params.get<std::string>("stats", "false");
+			if (stats_name != "false")
+			{
+				EncoderStats::Summary stats = app.GetEncoderStats(stats_name == "true" ? "video" : stats_name);
+				reply.put("stats.frames", stats.frames);
+				reply.put("stats.keyframes", stats.keyframes);
+				reply.put("stats.dropped", stats.dropped);
+				reply.put("stats.input_latency_ms", stats.input_latency_ms);
+				reply.put("stats.max_input_latency_ms", stats.max_input_latency_ms);
+				reply.put("stats.output_latency_ms", stats.output_latency_ms);
+				reply.put("stats.max_output_latency_ms", stats.max_output_latency_ms);
+				reply.put("stats.frame_bytes", stats.frame_bytes);
+				reply.put("stats.keyframe_bytes", stats.keyframe_bytes);
+				reply.put("stats.max_keyframe_bytes", stats.max_keyframe_bytes);
+				reply.put("stats.bitrate", stats.bitrate);
+				reply.put("stats.average_bitrate", stats.average_bitrate);
+			}
+			socket.Reply(command.client, reply);
+		}
+		catch (std::exception const &e)
+		{
+			socket.ReplyError(command.client, e.what());
+		}
+	}
+
+	if (!controls.empty())
+		app.SetControls(controls);
+
+	return !quit;
+}
+
 // The main even loop for the application.
 
 static void event_loop(LibcameraEncoder &app)
@@ -65,6 +177,23 @@ static void event_loop(LibcameraEncoder &app)
 	VideoOptions const *options = app.GetOptions();
 	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
 	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
+	output->SetKeyframeRequestCallback([&app]() { app.RequestKeyframe("video"); });
+	app.SetEncodeResumeCallback([&output]() { output->Restart(); });
+	// Optionally, the low resolution stream gets encoded too, and sent somewhere else.
+	std::unique_ptr<Output> lores_output;
+	if (!options->lores_codec.empty())
+	{
+		lores_output = std::unique_ptr<Output>(Output::Create(app.GetLoresOptions()));
+		app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, lores_output.get(), _1, _2, _3, _4),
+										 "lores");
+		lores_output->SetKeyframeRequestCallback([&app]() { app.RequestKeyframe("lores"); });
+	}
+	std::unique_ptr<CommandSocket> socket;
+	if (!options->control_socket.empty())
+		socket = std::make_unique<CommandSocket>(options->control_socket, options->verbose);
+	std::unique_ptr<MetadataWriter> metadata_writer;
+	if (!options->save_metadata.empty())
+		metadata_writer = std::make_unique<MetadataWriter>(options->save_metadata);
 
 	app.OpenCamera();
 	app.ConfigureVideo(get_colourspace_flags(options->codec));
@@ -77,6 +206,7 @@ static void event_loop(LibcameraEncoder &app)
 	signal(SIGUSR2, default_signal_handler);
 	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
 
+	bool gate_open = false, gate_seen = false, gate_warned = false, gate_rejected = false;
 	for (unsigned int count = 0; ; count++)
 	{
 		LibcameraEncoder::Msg msg = app.Wait();
@@ -94,15 +224,49 @@ static void event_loop(LibcameraEncoder &app)
 		bool timeout = !options->frames && options->timeout &&
 					   (now - start_time > std::chrono::milliseconds(options->timeout));
 		bool frameout = options->frames && count >= options->frames;
-		if (timeout || frameout || key == 'x' || key == 'X')
+		bool quit = socket && !handle_commands(app, *socket);
+		if (timeout || frameout || quit || key == 'x' || key == 'X')
 		{
 			app.StopCamera(); // stop complains if encoder very slow to close
+			auto camera_stopped = std::chrono::high_resolution_clock::now();
 			app.StopEncoder();
+			auto encoder_stopped = std::chrono::high_resolution_clock::now();
+			std::chrono::duration<double, std::milli> stop_time = encoder_stopped - now;
+			std::chrono::duration<double, std::milli> encoder_stop_time = encoder_stopped - camera_stopped;
+			if (options->verbose)
+				std::cerr << "Stopped in " << stop_time.count() << "ms (encoder " << encoder_stop_time.count()
+						  << "ms)" << std::endl;
 			return;
 		}
 
 		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		// Don't waste time encoding frames that won't be output. The gate keeps its last
+		// value on frames that don't update it. A gate we can't read is dropped, rather than
+		// ending the recording.
+		if (!options->encode_gate.empty() && !gate_rejected)
+		{
+			try
+			{
+				gate_seen |= read_gate(completed_request->post_process_metadata, options->encode_gate, gate_open);
+			}
+			catch (std::exception const &e)
+			{
+				std::cerr << "ERROR: " << e.what() << " - encoding every frame" << std::endl;
+				gate_seen = gate_rejected = gate_open = true;
+			}
+			if (!gate_seen && !gate_warned && now - start_time > std::chrono::seconds(1))
+			{
+				std::cerr << "WARNING: no " << options->encode_gate << " result to gate encoding" << std::endl;
+				gate_warned = true;
+			}
+		}
+		app.SuspendEncoder(!output->Enabled() || (!options->encode_gate.empty() && !gate_open));
+		if (metadata_writer)
+			metadata_writer->Write(*completed_request,
+								   completed_request->buffers[app.VideoStream()]->metadata().timestamp / 1000);
 		app.EncodeBuffer(completed_request, app.VideoStream());
+		if (lores_output)
+			app.EncodeBuffer(completed_request, app.LoresStream());
 		app.ShowPreview(completed_request, app.VideoStream());
 	}
 }
@@ -0,0 +1,284 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * alloc_audit.cpp - count heap allocations made in steady state.
+ */
+
+#include <iostream>
+
+#include "core/alloc_audit.hpp"
+
+#if ALLOC_AUDIT_PRESENT
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+// Nothing in the allocation hooks may allocate, so everything is recorded into fixed
+// tables. Any sites or threads beyond these limits are simply counted as "overflow".
+
+static constexpr unsigned int MAX_SITES = 4096;
+static constexpr unsigned int MAX_THREADS = 64;
+
+struct Site
+{
+	std::atomic<uintptr_t> address;
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> bytes;
+};
+
+struct ThreadCount
+{
+	std::atomic<pid_t> tid;
+	std::atomic<uint64_t> count;
+};
+
+static Site sites[MAX_SITES];
+static ThreadCount threads[MAX_THREADS];
+static std::atomic<uint64_t> overflow;
+
+static std::atomic<bool> started;
+static std::atomic<bool> counting;
+static std::atomic<bool> stopped;
+static unsigned int warmup;
+static std::atomic<uint64_t> total_frames;
+static std::atomic<uint64_t> audited_frames;
+
+// "initial-exec" means no allocation happens the first time a thread touches this.
+static thread_local ThreadCount *thread_count __attribute__((tls_model("initial-exec"))) = nullptr;
+
+static void record(void *caller, size_t size)
+{
+	if (!counting.load(std::memory_order_relaxed))
+		return;
+
+	uintptr_t address = reinterpret_cast<uintptr_t>(caller);
+	unsigned int h = (address >> 2) * 2654435761u % MAX_SITES;
+	unsigned int i = 0;
+	for (; i < MAX_SITES; i++, h = (h + 1) % MAX_SITES)
+	{
+		uintptr_t expected = 0;
+		if (sites[h].address.load() == address || sites[h].address.compare_exchange_strong(expected, address) ||
+			expected == address)
+		{
+			sites[h].count++;
+			sites[h].bytes += size;
+			break;
+		}
+	}
+	if (i == MAX_SITES)
+		overflow++;
+
+	if (!thread_count)
+	{
+		pid_t tid = syscall(SYS_gettid);
+		for (unsigned int t = 0; t < MAX_THREADS && !thread_count; t++)
+		{
+			pid_t expected = 0;
+			if (threads[t].tid.compare_exchange_strong(expected, tid))
+				thread_count = &threads[t];
+		}
+	}
+	if (thread_count)
+		thread_count->count++;
+}
+
+extern "C"
+{
+	extern void *__libc_malloc(size_t size);
+	extern void *__libc_calloc(size_t n, size_t size);
+	extern void *__libc_realloc(void *ptr, size_t size);
+	extern void *__libc_memalign(size_t alignment, size_t size);
+
+	void *malloc(size_t size) noexcept
+	{
+		record(__builtin_return_address(0), size);
+		return __libc_malloc(size);
+	}
+
+	void *calloc(size_t n, size_t size) noexcept
+	{
+		record(__builtin_return_address(0), n * size);
+		return __libc_calloc(n, size);
+	}
+
+	void *realloc(void *ptr, size_t size) noexcept
+	{
+		record(__builtin_return_address(0), size);
+		return __libc_realloc(ptr, size);
+	}
+}
+
+// The default operator delete uses free(), so we don't need to replace it.
+
+static void *audited_new(size_t size, size_t alignment, void *caller)
+{
+	record(caller, size);
+	if (size == 0)
+		size = 1;
+	return alignment ? __libc_memalign(alignment, size) : __libc_malloc(size);
+}
+
+void *operator new(size_t size)
+{
+	void *ptr = audited_new(size, 0, __builtin_return_address(0));
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void *operator new[](size_t size)
+{
+	void *ptr = audited_new(size, 0, __builtin_return_address(0));
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void *operator new(size_t size, std::nothrow_t const &) noexcept
+{
+	return audited_new(size, 0, __builtin_return_address(0));
+}
+
+void *operator new[](size_t size, std::nothrow_t const &) noexcept
+{
+	return audited_new(size, 0, __builtin_return_address(0));
+}
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+	void *ptr = audited_new(size, static_cast<size_t>(alignment), __builtin_return_address(0));
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+	void *ptr = audited_new(size, static_cast<size_t>(alignment), __builtin_return_address(0));
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+// Allocations made directly by libcamera-apps code, as opposed to libcamera or the
+// system libraries, are the ones we can do something about.
+static bool is_our_code(char const *filename)
+{
+	static char const *libraries[] = { "libcamera_app.so", "libencoders.so", "liboutputs.so", "libpreview.so",
+									   "libpost_processing_stages.so", "libimages.so" };
+	char const *name = strrchr(filename, '/');
+	name = name ? name + 1 : filename;
+	for (char const *library : libraries)
+	{
+		if (strcmp(name, library) == 0)
+			return true;
+	}
+	// Otherwise it might be one of the executables.
+	return strncmp(name, "libcamera-", 10) == 0 && !strstr(name, ".so");
+}
+
+void alloc_audit_start(unsigned int warmup_frames)
+{
+	if (started.exchange(true))
+		return;
+	warmup = warmup_frames;
+}
+
+void alloc_audit_frame_done()
+{
+	if (!started || stopped)
+		return;
+	uint64_t frame = ++total_frames;
+	if (frame == warmup)
+		counting = true;
+	else if (frame > warmup)
+		audited_frames++;
+}
+
+void alloc_audit_stop()
+{
+	counting = false;
+	if (started)
+		stopped = true;
+}
+
+void alloc_audit_report()
+{
+	if (!started)
+		return;
+	counting = false;
+
+	std::vector<Site const *> used;
+	for (Site const &site : sites)
+	{
+		if (site.count)
+			used.push_back(&site);
+	}
+	std::sort(used.begin(), used.end(), [](Site const *a, Site const *b) { return a->count > b->count; });
+
+	uint64_t frames = audited_frames;
+	uint64_t ours = 0, others = overflow;
+	std::cerr << "Allocation audit: " << frames << " frames after " << warmup << " warm-up frames" << std::endl;
+	for (Site const *site : used)
+	{
+		Dl_info info = {};
+		void *address = reinterpret_cast<void *>(site->address.load());
+		bool found = dladdr(address, &info) && info.dli_fname;
+		bool our_code = found && is_our_code(info.dli_fname);
+		(our_code ? ours : others) += site->count;
+
+		std::string symbol = "?";
+		if (found && info.dli_sname)
+		{
+			int status;
+			char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+			symbol = status == 0 ? demangled : info.dli_sname;
+			free(demangled);
+		}
+		uintptr_t offset = reinterpret_cast<uintptr_t>(address) -
+						   reinterpret_cast<uintptr_t>(found && info.dli_saddr ? info.dli_saddr : info.dli_fbase);
+		std::cerr << "    " << site->count << " allocations (" << site->bytes << " bytes";
+		if (frames)
+			std::cerr << ", " << (double)site->count / frames << " per frame";
+		std::cerr << ") at " << symbol << "+0x" << std::hex << offset << std::dec << " in "
+				  << (found ? info.dli_fname : "?") << (our_code ? "" : " (external)") << std::endl;
+	}
+	for (ThreadCount const &thread : threads)
+	{
+		if (thread.tid && thread.count)
+			std::cerr << "    thread " << thread.tid << ": " << thread.count << " allocations" << std::endl;
+	}
+	std::cerr << "Steady-state allocations: app " << ours << ", external " << others << std::endl;
+}
+
+#else
+
+void alloc_audit_start(unsigned int warmup_frames)
+{
+	std::cerr << "WARNING: allocation audit not built in - rebuild with -DENABLE_ALLOC_AUDIT=1" << std::endl;
+}
+
+void alloc_audit_frame_done()
+{
+}
+
+void alloc_audit_stop()
+{
+}
+
+void alloc_audit_report()
+{
+}
+
+#endif
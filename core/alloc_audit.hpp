@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * alloc_audit.hpp - count heap allocations made in steady state.
+ */
+
+#pragma once
+
+// When built with ENABLE_ALLOC_AUDIT, all heap allocations (operator new and malloc)
+// made after a number of "warm-up" frames are counted by call site and by thread.
+// The audit stops when the camera is first stopped, and the results are reported
+// at exit. Without ENABLE_ALLOC_AUDIT these functions do nothing (except warn).
+
+void alloc_audit_start(unsigned int warmup_frames);
+void alloc_audit_frame_done();
+void alloc_audit_stop();
+void alloc_audit_report();
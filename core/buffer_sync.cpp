@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * buffer_sync.cpp - CPU access to camera buffers.
+ */
+
+#include <sys/ioctl.h>
+
+#include <linux/dma-buf.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+
+#include "core/buffer_sync.hpp"
+#include "core/libcamera_app.hpp"
+
+// Copies of slow buffers are recycled, as they're often large.
+static std::mutex pool_mutex;
+static std::vector<std::vector<uint8_t>> pool;
+static constexpr unsigned int MAX_POOL_SIZE = 4;
+
+static std::vector<int> buffer_fds(libcamera::FrameBuffer *fb)
+{
+	std::vector<int> fds;
+	for (auto const &plane : fb->planes())
+	{
+		if (std::find(fds.begin(), fds.end(), plane.fd.get()) == fds.end())
+			fds.push_back(plane.fd.get());
+	}
+	return fds;
+}
+
+static void dma_sync(std::vector<int> const &fds, uint64_t flags)
+{
+	for (int fd : fds)
+	{
+		dma_buf_sync sync = { flags };
+		int ret;
+		do
+		{
+			ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+		} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+		if (ret < 0)
+			std::cerr << "WARNING: DMA_BUF_IOCTL_SYNC failed on fd " << fd << ", errno " << errno << std::endl;
+	}
+}
+
+BufferReadSync::BufferReadSync(LibcameraApp *app, libcamera::FrameBuffer *fb, bool cached_copy)
+	: fds_(buffer_fds(fb)), planes_(app->Mmap(fb))
+{
+	if (planes_.empty())
+		throw std::runtime_error("BufferReadSync: buffer not mapped");
+
+	dma_sync(fds_, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+
+	if (!cached_copy || !app->SlowMapping(fb))
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		if (!pool.empty())
+		{
+			copy_ = std::move(pool.back());
+			pool.pop_back();
+		}
+	}
+
+	size_t size = 0;
+	for (auto const &span : planes_)
+		size += span.size();
+	copy_.resize(size);
+
+	// Point the planes at the copy instead. We've finished with the mapping now too.
+	uint8_t *dest = copy_.data();
+	for (auto &span : planes_)
+	{
+		memcpy(dest, span.data(), span.size());
+		span = libcamera::Span<uint8_t>(dest, span.size());
+		dest += span.size();
+	}
+
+	dma_sync(fds_, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+	fds_.clear();
+}
+
+BufferReadSync::~BufferReadSync()
+{
+	dma_sync(fds_, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+	if (!copy_.empty())
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+		if (pool.size() < MAX_POOL_SIZE)
+			pool.push_back(std::move(copy_));
+	}
+}
+
+BufferWriteSync::BufferWriteSync(LibcameraApp *app, libcamera::FrameBuffer *fb)
+	: fds_(buffer_fds(fb)), planes_(app->Mmap(fb))
+{
+	if (planes_.empty())
+		throw std::runtime_error("BufferWriteSync: buffer not mapped");
+
+	dma_sync(fds_, DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW);
+}
+
+BufferWriteSync::~BufferWriteSync()
+{
+	dma_sync(fds_, DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW);
+}
+
+static double read_rate(uint8_t const *mem, size_t size)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+	uint64_t const *words = reinterpret_cast<uint64_t const *>(mem);
+	uint64_t sum = 0;
+	for (size_t i = 0; i < size / sizeof(uint64_t); i++)
+		sum += words[i];
+	volatile uint64_t result = sum; // stop the loop being optimised away
+	(void)result;
+	std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+	return size / elapsed.count() / 1e6;
+}
+
+void MeasureReadBandwidth(libcamera::FrameBuffer *fb, libcamera::Span<uint8_t> mem, double &mapped_rate,
+						  double &cached_rate)
+{
+	// A quarter of a megabyte is plenty to tell cached and uncached memory apart.
+	size_t size = std::min(mem.size(), (size_t)1 << 18);
+	std::vector<int> fds = buffer_fds(fb);
+
+	dma_sync(fds, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+	mapped_rate = read_rate(mem.data(), size);
+	dma_sync(fds, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+	std::vector<uint8_t> cached(size, 1);
+	read_rate(cached.data(), size); // warm the cache, as would happen with a real copy
+	cached_rate = read_rate(cached.data(), size);
+}
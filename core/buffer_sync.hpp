@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * buffer_sync.hpp - CPU access to camera buffers.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <libcamera/base/span.h>
+#include <libcamera/framebuffer.h>
+
+class LibcameraApp;
+
+// Camera buffers are dmabufs, and CPU access to them should be bracketed with
+// DMA_BUF_IOCTL_SYNC so that caches are kept coherent with the hardware. Create
+// one of these objects around the code that touches the pixels, and use Get()
+// in place of LibcameraApp::Mmap().
+
+class BufferReadSync
+{
+public:
+	// When cached_copy is set and the mapping has been measured to be slow (i.e.
+	// uncached), Get() returns a copy in ordinary memory instead, from a small pool
+	// of recycled buffers. Read-only consumers should ask for this.
+	BufferReadSync(LibcameraApp *app, libcamera::FrameBuffer *fb, bool cached_copy = false);
+	~BufferReadSync();
+
+	std::vector<libcamera::Span<uint8_t>> const &Get() const { return planes_; }
+
+private:
+	std::vector<int> fds_;
+	std::vector<libcamera::Span<uint8_t>> planes_;
+	std::vector<uint8_t> copy_;
+};
+
+class BufferWriteSync
+{
+public:
+	BufferWriteSync(LibcameraApp *app, libcamera::FrameBuffer *fb);
+	~BufferWriteSync();
+
+	std::vector<libcamera::Span<uint8_t>> const &Get() const { return planes_; }
+
+private:
+	std::vector<int> fds_;
+	std::vector<libcamera::Span<uint8_t>> planes_;
+};
+
+// Measure the rate (in MB/s) at which the CPU reads the given buffer mapping, and
+// the rate for ordinary memory, for comparison.
+void MeasureReadBandwidth(libcamera::FrameBuffer *fb, libcamera::Span<uint8_t> mem, double &mapped_rate,
+						  double &cached_rate);
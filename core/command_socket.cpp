@@ -0,0 +1,237 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * command_socket.cpp - receive JSON commands over a Unix domain socket.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <libcamera/control_ids.h>
+
+#include "core/command_socket.hpp"
+
+#include <boost/property_tree/json_parser.hpp>
+
+using boost::property_tree::ptree;
+
+CommandSocket::CommandSocket(std::string const &path, bool verbose) : path_(path), verbose_(verbose)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("socket path too long: " + path);
+	strcpy(addr.sun_path, path.c_str());
+
+	listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open command socket");
+
+	// A previous instance may have left its socket behind.
+	unlink(path.c_str());
+	if (bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		close(listen_fd_);
+		throw std::runtime_error("failed to bind command socket " + path);
+	}
+	if (listen(listen_fd_, 4) < 0)
+	{
+		close(listen_fd_);
+		throw std::runtime_error("failed to listen on command socket " + path);
+	}
+
+	if (verbose_)
+		std::cerr << "Listening for commands on " << path << std::endl;
+}
+
+CommandSocket::~CommandSocket()
+{
+	for (auto &client : clients_)
+		close(client.first);
+	close(listen_fd_);
+	unlink(path_.c_str());
+}
+
+std::vector<CommandSocket::Command> CommandSocket::Poll()
+{
+	std::vector<Command> commands;
+
+	acceptClients();
+
+	for (auto it = clients_.begin(); it != clients_.end();)
+	{
+		if (readClient(it->first, it->second, commands))
+			it++;
+		else
+		{
+			if (verbose_)
+				std::cerr << "Command client " << it->second.id << " disconnected" << std::endl;
+			close(it->first);
+			it = clients_.erase(it);
+		}
+	}
+
+	return commands;
+}
+
+std::map<int, CommandSocket::Client>::const_iterator CommandSocket::findClient(int id) const
+{
+	return std::find_if(clients_.begin(), clients_.end(), [id](auto const &c) { return c.second.id == id; });
+}
+
+void CommandSocket::Reply(int client, ptree const &reply)
+{
+	auto it = findClient(client);
+	if (it == clients_.end())
+		return;
+	int fd = it->first;
+
+	std::ostringstream ss;
+	boost::property_tree::write_json(ss, reply, false); // this ends with a newline
+	std::string line = ss.str();
+
+	for (size_t sent = 0; sent < line.size();)
+	{
+		ssize_t n = send(fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n <= 0)
+		{
+			if (verbose_)
+				std::cerr << "Failed to reply to command client " << client << std::endl;
+			return;
+		}
+		sent += n;
+	}
+}
+
+void CommandSocket::ReplyError(int client, std::string const &message)
+{
+	ptree reply;
+	reply.put("status", "error");
+	reply.put("message", message);
+	Reply(client, reply);
+}
+
+void CommandSocket::acceptClients()
+{
+	while (true)
+	{
+		int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			else if (errno != EAGAIN && errno != EWOULDBLOCK)
+				std::cerr << "WARNING: failed to accept command client, errno " << errno << std::endl;
+			return;
+		}
+		clients_[fd] = { ++next_client_id_, "" };
+		if (verbose_)
+			std::cerr << "Command client " << next_client_id_ << " connected" << std::endl;
+	}
+}
+
+// Read whatever the client has sent us, splitting it into lines and parsing each
+// complete one. Returns false when the client has gone away.
+
+bool CommandSocket::readClient(int fd, Client &client, std::vector<Command> &commands)
+{
+	std::string &partial = client.partial;
+	char buf[1024];
+	bool connected = true;
+
+	while (true)
+	{
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		else if (n <= 0)
+		{
+			connected = false;
+			break;
+		}
+		partial.append(buf, n);
+	}
+
+	for (size_t pos; (pos = partial.find('\n')) != std::string::npos; partial.erase(0, pos + 1))
+	{
+		std::string line = partial.substr(0, pos);
+		if (line.find_first_not_of(" \t\r") == std::string::npos)
+			continue;
+
+		Command command;
+		command.client = client.id;
+		try
+		{
+			std::istringstream ss(line);
+			boost::property_tree::read_json(ss, command.params);
+		}
+		catch (std::exception const &e)
+		{
+			ReplyError(client.id, std::string("bad command: ") + e.what());
+			continue;
+		}
+		if (verbose_)
+			std::cerr << "Command received: " << line << std::endl;
+		commands.push_back(std::move(command));
+	}
+
+	return connected;
+}
+
+libcamera::ControlList CommandSocket::ParseControls(ptree const &params)
+{
+	using namespace libcamera;
+	ControlList controls(controls::controls);
+
+	for (auto const &p : params)
+	{
+		std::string const &name = p.first;
+		ptree const &value = p.second;
+
+		if (name == "ExposureTime")
+			controls.set(controls::ExposureTime, value.get_value<int32_t>());
+		else if (name == "AnalogueGain")
+			controls.set(controls::AnalogueGain, value.get_value<float>());
+		else if (name == "ExposureValue")
+			controls.set(controls::ExposureValue, value.get_value<float>());
+		else if (name == "AeMeteringMode")
+			controls.set(controls::AeMeteringMode, value.get_value<int32_t>());
+		else if (name == "AeExposureMode")
+			controls.set(controls::AeExposureMode, value.get_value<int32_t>());
+		else if (name == "AwbMode")
+			controls.set(controls::AwbMode, value.get_value<int32_t>());
+		else if (name == "Brightness")
+			controls.set(controls::Brightness, value.get_value<float>());
+		else if (name == "Contrast")
+			controls.set(controls::Contrast, value.get_value<float>());
+		else if (name == "Saturation")
+			controls.set(controls::Saturation, value.get_value<float>());
+		else if (name == "Sharpness")
+			controls.set(controls::Sharpness, value.get_value<float>());
+		else if (name == "ColourGains")
+		{
+			std::vector<float> gains;
+			for (auto const &g : value)
+				gains.push_back(g.second.get_value<float>());
+			if (gains.size() != 2)
+				throw std::runtime_error("ColourGains needs red and blue values");
+			controls.set(controls::ColourGains, { gains[0], gains[1] });
+		}
+		else
+			throw std::runtime_error("unrecognised control " + name);
+	}
+
+	return controls;
+}
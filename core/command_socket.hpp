@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * command_socket.hpp - receive JSON commands over a Unix domain socket.
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Prevents compiler warnings in Boost headers with more recent versions of GCC.
+#define BOOST_BIND_GLOBAL_PLACEHOLDERS
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <libcamera/controls.h>
+
+// Listens on a Unix domain socket for commands, one JSON object per line. Any
+// number of clients may connect. The socket is never waited on; applications
+// call Poll() once per frame so that commands are only ever acted on between
+// frames.
+
+class CommandSocket
+{
+public:
+	struct Command
+	{
+		int client; // pass back to Reply(); never re-used, unlike the socket's fd
+		boost::property_tree::ptree params;
+	};
+
+	CommandSocket(std::string const &path, bool verbose = false);
+	~CommandSocket();
+
+	// Return the commands that have arrived since the last call, without blocking.
+	std::vector<Command> Poll();
+
+	// Send a single line reply to the client that sent a command. Clients that
+	// have since gone away are silently ignored.
+	void Reply(int client, boost::property_tree::ptree const &reply);
+	void ReplyError(int client, std::string const &message);
+	// Whether the client is still there to reply to.
+	bool Connected(int client) const { return findClient(client) != clients_.end(); }
+
+	// Turn a JSON object of control names and values into a ControlList, for
+	// example { "ExposureTime": 20000, "ColourGains": [ 1.5, 1.2 ] }.
+	static libcamera::ControlList ParseControls(boost::property_tree::ptree const &params);
+
+private:
+	struct Client
+	{
+		int id;
+		std::string partial; // any incomplete line
+	};
+
+	void acceptClients();
+	bool readClient(int fd, Client &client, std::vector<Command> &commands);
+	std::map<int, Client>::const_iterator findClient(int id) const;
+
+	std::string path_;
+	bool verbose_;
+	int listen_fd_;
+	std::map<int, Client> clients_; // by fd
+	int next_client_id_ = 0;
+};
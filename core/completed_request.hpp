@@ -25,6 +25,18 @@ struct CompletedRequest
 	{
 		r->reuse();
 	}
+	// Re-use this object for another request. Assigning, rather than constructing
+	// afresh, lets the containers keep the memory they already have.
+	void Reset(unsigned int seq, Request *r)
+	{
+		sequence = seq;
+		buffers = r->buffers();
+		metadata = r->metadata();
+		request = r;
+		framerate = 0;
+		post_process_metadata.Clear();
+		r->reuse();
+	}
 	unsigned int sequence;
 	BufferMap buffers;
 	ControlList metadata;
@@ -0,0 +1,122 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * executor.cpp - shared pool of worker threads with priorities.
+ */
+
+#include "core/executor.hpp"
+
+// Which worker the current thread is, if any, and which task it's running.
+static thread_local int worker_index = -1;
+static thread_local uint64_t current_task = 0;
+
+Executor &Executor::Get()
+{
+	static Executor executor(std::max(2u, std::thread::hardware_concurrency()));
+	return executor;
+}
+
+Executor::Executor(unsigned int num_threads) : next_worker_(0), pending_(0), posted_(0), quit_(false)
+{
+	for (unsigned int i = 0; i < num_threads; i++)
+		workers_.push_back(std::make_unique<Worker>());
+	for (unsigned int i = 0; i < num_threads; i++)
+		workers_[i]->thread = std::thread(&Executor::workerThread, this, i);
+}
+
+Executor::~Executor()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex_);
+		quit_ = true;
+	}
+	sleep_cond_var_.notify_all();
+	for (auto &worker : workers_)
+		worker->thread.join();
+}
+
+void Executor::post(Priority priority, Task task)
+{
+	// Workers keep their own tasks, which are more likely to find their data in cache.
+	unsigned int index = worker_index >= 0 ? worker_index : next_worker_++ % workers_.size();
+	{
+		std::lock_guard<std::mutex> lock(workers_[index]->mutex);
+		workers_[index]->queues[priority].push(Entry { std::move(task), ++posted_, current_task });
+		pending_++;
+	}
+	// Taking the lock means we can't slip in between a sleeper checking pending_ and waiting.
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex_);
+	}
+	sleep_cond_var_.notify_all();
+}
+
+// Run the most urgent task we can find, looking in our own queues first. With a
+// parent, only that task's subtasks will do. Returns false if there was nothing to do.
+bool Executor::runOne(unsigned int self, uint64_t parent)
+{
+	Entry entry;
+	bool found = false;
+	for (unsigned int priority = 0; priority < NUM_PRIORITIES && !found; priority++)
+	{
+		for (unsigned int i = 0; i < workers_.size() && !found; i++)
+		{
+			Worker &worker = *workers_[(self + i) % workers_.size()];
+			std::lock_guard<std::mutex> lock(worker.mutex);
+			RecyclingQueue<Entry> &queue = worker.queues[priority];
+			if (!parent && !queue.empty())
+			{
+				entry = queue.pop_front();
+				found = true;
+			}
+			else if (parent)
+				found = queue.pop_first_if([parent](Entry const &e) { return e.parent == parent; }, entry);
+			if (found)
+				pending_--;
+		}
+	}
+	if (!found)
+		return false;
+
+	uint64_t outer_task = current_task;
+	current_task = entry.id;
+	entry.task();
+	entry.task = nullptr; // release what it captured now, not when the entry is next re-used
+	current_task = outer_task;
+	// Anyone waiting on the result of this task needs to know.
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex_);
+	}
+	sleep_cond_var_.notify_all();
+	return true;
+}
+
+void Executor::waitUntil(std::function<bool()> const &done)
+{
+	// Only a worker in the middle of a task has subtasks it can run.
+	bool helping = worker_index >= 0 && current_task;
+	while (!done())
+	{
+		uint64_t posted = posted_;
+		if (helping && runOne(worker_index, current_task))
+			continue;
+		// Sleep until something finishes, or something new is posted that might be ours.
+		std::unique_lock<std::mutex> lock(sleep_mutex_);
+		sleep_cond_var_.wait(lock, [this, &done, helping, posted] { return done() || (helping && posted_ != posted); });
+	}
+}
+
+void Executor::workerThread(unsigned int index)
+{
+	worker_index = index;
+	while (true)
+	{
+		if (runOne(index))
+			continue;
+		std::unique_lock<std::mutex> lock(sleep_mutex_);
+		sleep_cond_var_.wait(lock, [this] { return quit_ || pending_; });
+		if (quit_ && !pending_)
+			return;
+	}
+}
@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * executor.hpp - shared pool of worker threads with priorities.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "core/recycling_queue.hpp"
+
+// One pool of worker threads, one per core, that runs short tasks for everyone
+// (post-processing, encoding, analysis) instead of each having its own threads.
+// Every worker has its own queues, and an idle worker steals from the others.
+// More urgent work always goes first, so when the CPU is overloaded it's the
+// analysis that falls behind, not the camera or the encoder.
+//
+// Tasks shouldn't block for long. A task that must wait for tasks it submitted
+// itself should do so with Wait(), which runs those tasks meanwhile so the pool
+// can't deadlock. Nothing else is run while waiting, so the waiting task can't
+// find itself re-entered, or stuck behind some less urgent job.
+
+class Executor
+{
+public:
+	enum Priority
+	{
+		CAPTURE = 0, // holding up camera buffers, e.g. post-processing
+		ENCODE,
+		PREVIEW,
+		ANALYTICS, // e.g. neural networks, which can always run a bit later
+		NUM_PRIORITIES
+	};
+
+	static Executor &Get();
+
+	// Run a function on the pool, returning a future for its result.
+	template <typename F>
+	auto Submit(Priority priority, F &&fn) -> std::future<decltype(fn())>
+	{
+		using R = decltype(fn());
+		auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(fn));
+		std::future<R> future = task->get_future();
+		post(priority, [task]() { (*task)(); });
+		return future;
+	}
+
+	// Run a function on the pool with no result.
+	void Post(Priority priority, std::function<void()> fn) { post(priority, std::move(fn)); }
+
+	// Wait for a future. A worker runs the current task's own subtasks while it waits.
+	template <typename T>
+	T Wait(std::future<T> &future)
+	{
+		waitUntil([&future]() { return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready; });
+		return future.get();
+	}
+
+	unsigned int NumThreads() const { return workers_.size(); }
+
+private:
+	typedef std::function<void()> Task;
+	struct Entry
+	{
+		Task task;
+		uint64_t id;
+		uint64_t parent; // the task that posted this one, or 0
+	};
+	struct Worker
+	{
+		std::mutex mutex;
+		RecyclingQueue<Entry> queues[NUM_PRIORITIES];
+		std::thread thread;
+	};
+
+	Executor(unsigned int num_threads);
+	~Executor();
+	void post(Priority priority, Task task);
+	bool runOne(unsigned int self, uint64_t parent = 0);
+	void waitUntil(std::function<bool()> const &done);
+	void workerThread(unsigned int index);
+
+	std::vector<std::unique_ptr<Worker>> workers_;
+	std::atomic<unsigned int> next_worker_;
+	std::atomic<unsigned int> pending_;
+	std::atomic<uint64_t> posted_; // total tasks ever posted, which also gives them their ids
+	bool quit_;
+	// Idle threads sleep here, and are woken when a task is posted or completes.
+	std::mutex sleep_mutex_;
+	std::condition_variable sleep_cond_var_;
+};
@@ -7,16 +7,86 @@
 
 #include "preview/preview.hpp"
 
+#include "core/alloc_audit.hpp"
+#include "core/buffer_sync.hpp"
 #include "core/frame_info.hpp"
 #include "core/libcamera_app.hpp"
+#include "core/memory_report.hpp"
 #include "core/options.hpp"
 
+#include <cmath>
+
 #include <fcntl.h>
 
 #include <sys/ioctl.h>
 
 #include <linux/videodev2.h>
 
+// Recycles the shared_ptr control blocks for CompletedRequests, so that making a
+// new CompletedRequestPtr doesn't normally allocate memory.
+template <typename T>
+class RecyclingAllocator
+{
+public:
+	using value_type = T;
+	RecyclingAllocator() = default;
+	template <typename U>
+	RecyclingAllocator(RecyclingAllocator<U> const &)
+	{
+	}
+	T *allocate(std::size_t n)
+	{
+		if (n == 1)
+		{
+			std::lock_guard<std::mutex> lock(pool().mutex);
+			if (!pool().free.empty())
+			{
+				T *p = pool().free.back();
+				pool().free.pop_back();
+				return p;
+			}
+		}
+		return std::allocator<T>().allocate(n);
+	}
+	void deallocate(T *p, std::size_t n)
+	{
+		if (n == 1)
+		{
+			std::lock_guard<std::mutex> lock(pool().mutex);
+			pool().free.push_back(p);
+		}
+		else
+			std::allocator<T>().deallocate(p, n);
+	}
+	template <typename U>
+	bool operator==(RecyclingAllocator<U> const &) const
+	{
+		return true;
+	}
+	template <typename U>
+	bool operator!=(RecyclingAllocator<U> const &) const
+	{
+		return false;
+	}
+
+private:
+	struct Pool
+	{
+		~Pool()
+		{
+			for (T *p : free)
+				std::allocator<T>().deallocate(p, 1);
+		}
+		std::mutex mutex;
+		std::vector<T *> free;
+	};
+	static Pool &pool()
+	{
+		static Pool pool;
+		return pool;
+	}
+};
+
 // If we definitely appear to be running the old camera stack, complain and give up.
 // Everything else, Pi or not, we let through.
 
@@ -74,9 +144,17 @@ LibcameraApp::~LibcameraApp()
 		std::cerr << "Closing Libcamera application"
 				  << "(frames displayed " << preview_frames_displayed_ << ", dropped " << preview_frames_dropped_ << ")"
 				  << std::endl;
+	if (options_->verbose && !options_->help)
+		std::cerr << "Frames lost: sensor " << GetDrops(DropCause::Sensor) << ", no request "
+				  << GetDrops(DropCause::NoRequest) << ", post-processor " << GetDrops(DropCause::PostProcessor)
+				  << ", encoder " << GetDrops(DropCause::Encoder) << ", output " << GetDrops(DropCause::Output)
+				  << std::endl;
 	StopCamera();
 	Teardown();
 	CloseCamera();
+	alloc_audit_report();
+	if (options_->memory_report >= 0)
+		memory_report_print("exit");
 }
 
 std::string const &LibcameraApp::CameraId() const
@@ -117,6 +195,8 @@ void LibcameraApp::OpenCamera()
 
 	if (!options_->post_process_file.empty())
 		post_processor_.Read(options_->post_process_file);
+	if (options_->post_process_reload)
+		post_processor_.Watch(options_->post_process_file);
 	// The queue takes over ownership from the post-processor.
 	post_processor_.SetCallback(
 		[this](CompletedRequestPtr &r) { this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r))); });
@@ -372,6 +452,10 @@ void LibcameraApp::Teardown()
 			munmap(span.data(), span.size());
 	}
 	mapped_buffers_.clear();
+	slow_buffers_.clear();
+	for (auto const &owner : dmabuf_owners_)
+		memory_report_set(owner, 0);
+	dmabuf_owners_.clear();
 
 	delete allocator_;
 	allocator_ = nullptr;
@@ -385,6 +469,9 @@ void LibcameraApp::Teardown()
 
 void LibcameraApp::StartCamera()
 {
+	if (options_->alloc_audit)
+		alloc_audit_start(options_->alloc_audit);
+
 	// This makes all the Request objects that we shall need.
 	makeRequests();
 
@@ -392,13 +479,7 @@ void LibcameraApp::StartCamera()
 	// We don't overwrite anything the application may have set before calling us.
 	if (!controls_.contains(controls::ScalerCrop) && options_->roi_width != 0 && options_->roi_height != 0)
 	{
-		Rectangle sensor_area = camera_->properties().get(properties::ScalerCropMaximum);
-		int x = options_->roi_x * sensor_area.width;
-		int y = options_->roi_y * sensor_area.height;
-		int w = options_->roi_width * sensor_area.width;
-		int h = options_->roi_height * sensor_area.height;
-		Rectangle crop(x, y, w, h);
-		crop.translateBy(sensor_area.topLeft());
+		Rectangle crop = RoiToScalerCrop(options_->roi_x, options_->roi_y, options_->roi_width, options_->roi_height);
 		if (options_->verbose)
 			std::cerr << "Using crop " << crop.toString() << std::endl;
 		controls_.set(controls::ScalerCrop, crop);
@@ -448,17 +529,35 @@ void LibcameraApp::StartCamera()
 	controls_.clear();
 	camera_started_ = true;
 	last_timestamp_ = 0;
+	requests_in_flight_ = 0;
+	sensor_sequence_valid_ = false;
 
 	camera_->requestCompleted.connect(this, &LibcameraApp::requestComplete);
 
 	for (std::unique_ptr<Request> &request : requests_)
 	{
+		{
+			std::lock_guard<std::mutex> lock(control_mutex_);
+			applyBracketControls(request.get());
+		}
+		{
+			std::lock_guard<std::mutex> lock(starvation_mutex_);
+			requests_in_flight_++;
+		}
 		if (camera_->queueRequest(request.get()) < 0)
 			throw std::runtime_error("Failed to queue request");
 	}
+	dry_time_ = std::chrono::duration<double>(0);
 
 	if (options_->verbose)
 		std::cerr << "Camera started!" << std::endl;
+
+	if (options_->memory_report >= 0)
+	{
+		memory_report_print("startup");
+		memory_report_phase("running");
+		last_memory_report_ = std::chrono::steady_clock::now();
+	}
 }
 
 void LibcameraApp::StopCamera()
@@ -477,18 +576,29 @@ void LibcameraApp::StopCamera()
 		}
 	}
 
+	alloc_audit_stop();
+	if (options_->memory_report >= 0)
+		memory_report_phase("stopped");
+
 	if (camera_)
 		camera_->requestCompleted.disconnect(this, &LibcameraApp::requestComplete);
 
 	// An application might be holding a CompletedRequest, so queueRequest will get
-	// called to delete it later, but we need to know not to try and re-queue it.
-	completed_requests_.clear();
+	// called to recycle it later, but we need to know not to try and re-queue it.
+	{
+		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
+		for (auto &p : completed_requests_)
+			p.second = false;
+	}
 
 	msg_queue_.Clear();
 
 	requests_.clear();
 
 	controls_.clear(); // no need for mutex here
+	bracket_controls_ = {};
+	bracket_requests_.clear();
+	bracket_targets_ = {};
 
 	if (options_->verbose && !options_->help)
 		std::cerr << "Camera stopped!" << std::endl;
@@ -496,44 +606,61 @@ void LibcameraApp::StopCamera()
 
 LibcameraApp::Msg LibcameraApp::Wait()
 {
+	if (options_->memory_report > 0)
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (now - last_memory_report_ >= std::chrono::seconds(options_->memory_report))
+		{
+			memory_report_print("periodic");
+			last_memory_report_ = now;
+		}
+	}
+
 	return msg_queue_.Wait();
 }
 
 void LibcameraApp::queueRequest(CompletedRequest *completed_request)
 {
-	BufferMap buffers(std::move(completed_request->buffers));
-
 	Request *request = completed_request->request;
-	delete completed_request;
 	assert(request);
 
 	// This function may run asynchronously so needs protection from the
 	// camera stopping at the same time.
 	std::lock_guard<std::mutex> stop_lock(camera_stop_mutex_);
-	if (!camera_started_)
-		return;
 
 	// An application could be holding a CompletedRequest while it stops and re-starts
 	// the camera, after which we don't want to queue another request now.
+	bool live;
 	{
 		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
-		auto it = completed_requests_.find(completed_request);
-		if (it == completed_requests_.end())
-			return;
-		completed_requests_.erase(it);
+		live = camera_started_ && completed_requests_[completed_request];
+		completed_requests_[completed_request] = false;
 	}
 
-	for (auto const &p : buffers)
+	if (live)
 	{
-		if (request->addBuffer(p.first, p.second) < 0)
-			throw std::runtime_error("failed to add buffer to request in QueueRequest");
+		for (auto const &p : completed_request->buffers)
+		{
+			if (request->addBuffer(p.first, p.second) < 0)
+				throw std::runtime_error("failed to add buffer to request in QueueRequest");
+		}
 	}
 
+	recycleCompletedRequest(completed_request);
+	if (!live)
+		return;
+
 	{
 		std::lock_guard<std::mutex> lock(control_mutex_);
 		request->controls() = std::move(controls_);
+		applyBracketControls(request);
 	}
 
+	{
+		std::lock_guard<std::mutex> lock(starvation_mutex_);
+		if (requests_in_flight_++ == 0)
+			dry_time_ += std::chrono::steady_clock::now() - dry_since_;
+	}
 	if (camera_->queueRequest(request) < 0)
 		throw std::runtime_error("failed to queue request");
 }
@@ -589,11 +716,12 @@ libcamera::Stream *LibcameraApp::GetMainStream() const
 	return nullptr;
 }
 
-std::vector<libcamera::Span<uint8_t>> LibcameraApp::Mmap(FrameBuffer *buffer) const
+std::vector<libcamera::Span<uint8_t>> const &LibcameraApp::Mmap(FrameBuffer *buffer) const
 {
+	static const std::vector<libcamera::Span<uint8_t>> empty;
 	auto item = mapped_buffers_.find(buffer);
 	if (item == mapped_buffers_.end())
-		return {};
+		return empty;
 	return item->second;
 }
 
@@ -607,12 +735,129 @@ void LibcameraApp::ShowPreview(CompletedRequestPtr &completed_request, Stream *s
 	preview_cond_var_.notify_one();
 }
 
+libcamera::Rectangle LibcameraApp::RoiToScalerCrop(float x, float y, float width, float height) const
+{
+	Rectangle sensor_area = camera_->properties().get(properties::ScalerCropMaximum);
+	Rectangle crop(x * sensor_area.width, y * sensor_area.height, width * sensor_area.width,
+				   height * sensor_area.height);
+	crop.translateBy(sensor_area.topLeft());
+	return crop;
+}
+
+void LibcameraApp::EnablePostProcessingStage(std::string const &name, bool enable)
+{
+	post_processor_.EnableStage(name, enable);
+}
+
 void LibcameraApp::SetControls(ControlList &controls)
 {
 	std::lock_guard<std::mutex> lock(control_mutex_);
 	controls_ = std::move(controls);
 }
 
+// Make controls that fix the exposure and colour gains at the values reported in this
+// frame's metadata, so that a new camera configuration starts where AE/AWB had got to.
+// Anything the user fixed on the command line is left alone.
+LibcameraApp::ControlList LibcameraApp::CarryControls(ControlList const &metadata, float exposure_scale) const
+{
+	ControlList controls(controls::controls);
+	if (!options_->shutter && metadata.contains(controls::ExposureTime))
+		controls.set(controls::ExposureTime, (int32_t)(metadata.get(controls::ExposureTime) * exposure_scale));
+	if (!options_->gain && metadata.contains(controls::AnalogueGain))
+		controls.set(controls::AnalogueGain, metadata.get(controls::AnalogueGain));
+	if (!(options_->awb_gain_r && options_->awb_gain_b) && metadata.contains(controls::ColourGains))
+	{
+		libcamera::Span<const float> gains = metadata.get(controls::ColourGains);
+		controls.set(controls::ColourGains, { gains[0], gains[1] });
+	}
+	if (options_->verbose)
+		std::cerr << "Carrying " << controls.size() << " exposure/colour controls into new configuration" << std::endl;
+	return controls;
+}
+
+// Each entry is applied to one request only, in order, so that consecutive frames can
+// be captured with different controls. Sensor controls take effect some frames after
+// the request carrying them, so the frames are tagged with "bracket.index" in their
+// post-processing metadata only once their exposure matches the bracket's.
+void LibcameraApp::SetBracketControls(std::vector<ControlList> const &brackets)
+{
+	std::lock_guard<std::mutex> lock(control_mutex_);
+	for (unsigned int i = 0; i < brackets.size(); i++)
+	{
+		bracket_controls_.emplace(i, brackets[i]);
+		BracketTarget target = { i, 0, 0, 0 };
+		if (brackets[i].contains(controls::ExposureTime))
+			target.exposure_time = brackets[i].get(controls::ExposureTime);
+		if (brackets[i].contains(controls::AnalogueGain))
+			target.analogue_gain = brackets[i].get(controls::AnalogueGain);
+		bracket_targets_.push(target);
+	}
+	brackets_applied_ = 0;
+}
+
+void LibcameraApp::RecordDrop(DropCause cause, unsigned int count)
+{
+	static char const *names[] = { "sensor", "no request", "post-processor", "encoder", "output" };
+	drops_[(unsigned int)cause] += count;
+	if (options_->verbose)
+		std::cerr << "Lost " << count << " frame(s), cause: " << names[(unsigned int)cause] << std::endl;
+}
+
+LibcameraApp::DropCause LibcameraApp::starvationCause()
+{
+	return post_processor_.Backlog() ? DropCause::PostProcessor : DropCause::NoRequest;
+}
+
+// Must be called with control_mutex_ held.
+void LibcameraApp::applyBracketControls(Request *request)
+{
+	if (bracket_controls_.empty())
+		return;
+
+	auto &[index, controls] = bracket_controls_.front();
+	controls.merge(request->controls()); // bracket values take precedence
+	request->controls() = std::move(controls);
+	bracket_requests_[request] = index;
+	bracket_controls_.pop();
+}
+
+// Must be called with control_mutex_ held.
+void LibcameraApp::tagBracketFrame(Request *request, CompletedRequest *completed_request)
+{
+	auto it = bracket_requests_.find(request);
+	if (it != bracket_requests_.end())
+	{
+		brackets_applied_ = it->second + 1;
+		bracket_requests_.erase(it);
+	}
+
+	// No frame can have a bracket's exposure before the request that set it has come back.
+	if (bracket_targets_.empty() || bracket_targets_.front().index >= brackets_applied_)
+		return;
+
+	// Exposures are quantised to whole sensor lines, and gains to the sensor's steps.
+	constexpr double TOLERANCE = 0.05;
+	constexpr unsigned int MAX_WAIT = 8;
+	BracketTarget &target = bracket_targets_.front();
+	ControlList const &metadata = request->metadata();
+	bool match = true;
+	if (target.exposure_time && metadata.contains(controls::ExposureTime))
+		match &= std::abs((double)metadata.get(controls::ExposureTime) - target.exposure_time) <=
+				 TOLERANCE * target.exposure_time;
+	if (target.analogue_gain && metadata.contains(controls::AnalogueGain))
+		match &= std::abs(metadata.get(controls::AnalogueGain) - target.analogue_gain) <=
+				 TOLERANCE * target.analogue_gain;
+
+	// The sensor may never reach the exposure (perhaps the frame duration limits it), so
+	// don't wait forever.
+	if (!match && ++target.frames_waited < MAX_WAIT)
+		return;
+	if (!match)
+		std::cerr << "WARNING: bracket " << target.index << " exposure not reached" << std::endl;
+	completed_request->post_process_metadata.Set("bracket.index", target.index);
+	bracket_targets_.pop();
+}
+
 StreamInfo LibcameraApp::GetStreamInfo(Stream const *stream) const
 {
 	StreamConfiguration const &cfg = stream->configuration();
@@ -627,6 +872,9 @@ StreamInfo LibcameraApp::GetStreamInfo(Stream const *stream) const
 
 void LibcameraApp::setupCapture()
 {
+	if (options_->memory_report >= 0)
+		memory_report_phase("configure");
+
 	// First finish setting up the configuration.
 
 	CameraConfiguration::Status validation = configuration_->validate();
@@ -646,6 +894,7 @@ void LibcameraApp::setupCapture()
 	for (StreamConfiguration &config : *configuration_)
 	{
 		Stream *stream = config.stream();
+		size_t stream_bytes = 0;
 
 		if (allocator_->allocate(stream) < 0)
 			throw std::runtime_error("failed to allocate capture buffers");
@@ -659,6 +908,7 @@ void LibcameraApp::setupCapture()
 			{
 				const FrameBuffer::Plane &plane = buffer->planes()[i];
 				buffer_size += plane.length;
+				stream_bytes += plane.length;
 				if (i == buffer->planes().size() - 1 || plane.fd.get() != buffer->planes()[i + 1].fd.get())
 				{
 					void *memory = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, plane.fd.get(), 0);
@@ -669,6 +919,34 @@ void LibcameraApp::setupCapture()
 			}
 			frame_buffers_[stream].push(buffer.get());
 		}
+		dmabuf_owners_.push_back("dmabuf " + config.toString() + " x" +
+								 std::to_string(allocator_->buffers(stream).size()));
+		memory_report_set(dmabuf_owners_.back(), stream_bytes);
+
+		// Find out whether CPU reads from these buffers are much slower than from ordinary
+		// (cached) memory, in which case read-only consumers get a copy instead. The answer
+		// won't change, so each stream configuration is only measured once.
+		if (!allocator_->buffers(stream).empty())
+		{
+			auto measured = measured_streams_.find(config.toString());
+			if (measured == measured_streams_.end())
+			{
+				FrameBuffer *buffer = allocator_->buffers(stream)[0].get();
+				double mapped_rate, cached_rate;
+				MeasureReadBandwidth(buffer, mapped_buffers_[buffer][0], mapped_rate, cached_rate);
+				bool slow = mapped_rate * 4 < cached_rate;
+				measured = measured_streams_.emplace(config.toString(), slow).first;
+				if (options_->verbose)
+					std::cerr << "Stream " << config.toString() << ": mapped reads " << (int)mapped_rate
+							  << " MB/s, cached reads " << (int)cached_rate << " MB/s"
+							  << (slow ? " - copying for read-only access" : "") << std::endl;
+			}
+			if (measured->second)
+			{
+				for (const std::unique_ptr<FrameBuffer> &b : allocator_->buffers(stream))
+					slow_buffers_.insert(b.get());
+			}
+		}
 	}
 	if (options_->verbose)
 		std::cerr << "Buffers allocated and mapped" << std::endl;
@@ -712,14 +990,58 @@ void LibcameraApp::makeRequests()
 
 void LibcameraApp::requestComplete(Request *request)
 {
+	std::chrono::duration<double> dry_time;
+	DropCause dry_cause;
+	bool dry;
+	{
+		std::lock_guard<std::mutex> lock(starvation_mutex_);
+		// The camera can't have been short of requests right up to now, as it had this one.
+		dry_time = dry_time_;
+		dry_cause = dry_cause_;
+		dry_time_ = std::chrono::duration<double>(0);
+		dry = --requests_in_flight_ == 0;
+		if (dry)
+			dry_since_ = std::chrono::steady_clock::now();
+	}
+	// Whoever is holding the requests now is the one to blame if this lasts. (Not asked
+	// under the lock, as derived classes may need their own locks.)
+	if (dry)
+	{
+		DropCause cause = starvationCause();
+		std::lock_guard<std::mutex> lock(starvation_mutex_);
+		dry_cause_ = cause;
+	}
 	if (request->status() == Request::RequestCancelled)
 		return;
 
-	CompletedRequest *r = new CompletedRequest(sequence_++, request);
-	CompletedRequestPtr payload(r, [this](CompletedRequest *cr) { this->queueRequest(cr); });
+	// Gaps in the sensor's frame sequence numbers are lost frames. Those we can account
+	// for by the time the camera spent with no requests since the previous frame are
+	// blamed on whoever was holding them; the rest on the sensor. A brief moment without
+	// requests doesn't lose a frame if one comes back before the next frame starts.
+	libcamera::FrameMetadata const &sensor_metadata = request->buffers().begin()->second->metadata();
+	if (sensor_sequence_valid_ && sensor_metadata.sequence > last_sensor_sequence_ + 1)
 	{
-		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
-		completed_requests_.insert(r);
+		unsigned int lost = sensor_metadata.sequence - last_sensor_sequence_ - 1;
+		double frame_interval = (sensor_metadata.timestamp - last_sensor_timestamp_) / 1e9 / (lost + 1);
+		unsigned int starved = 0;
+		if (frame_interval > 0)
+			starved = std::min<unsigned int>(lost, std::lround(dry_time.count() / frame_interval));
+		if (starved)
+			RecordDrop(dry_cause, starved);
+		if (lost > starved)
+			RecordDrop(DropCause::Sensor, lost - starved);
+	}
+	last_sensor_sequence_ = sensor_metadata.sequence;
+	last_sensor_timestamp_ = sensor_metadata.timestamp;
+	sensor_sequence_valid_ = true;
+
+	CompletedRequest *r = getCompletedRequest(request);
+	CompletedRequestPtr payload(
+		r, [this](CompletedRequest *cr) { this->queueRequest(cr); }, RecyclingAllocator<CompletedRequest>());
+
+	{
+		std::lock_guard<std::mutex> lock(control_mutex_);
+		tagBracketFrame(request, payload.get());
 	}
 
 	// We calculate the instantaneous framerate in case anyone wants it.
@@ -730,16 +1052,45 @@ void LibcameraApp::requestComplete(Request *request)
 		payload->framerate = 1e9 / (timestamp - last_timestamp_);
 	last_timestamp_ = timestamp;
 
+	alloc_audit_frame_done();
+
 	post_processor_.Process(payload); // post-processor can re-use our shared_ptr
 }
 
+// CompletedRequests are recycled rather than deleted, so that we don't have to keep
+// allocating memory for them.
+CompletedRequest *LibcameraApp::getCompletedRequest(Request *request)
+{
+	std::lock_guard<std::mutex> lock(completed_requests_mutex_);
+	CompletedRequest *r;
+	if (free_completed_requests_.empty())
+	{
+		completed_request_pool_.push_back(std::make_unique<CompletedRequest>(sequence_++, request));
+		r = completed_request_pool_.back().get();
+	}
+	else
+	{
+		r = free_completed_requests_.back();
+		free_completed_requests_.pop_back();
+		r->Reset(sequence_++, request);
+	}
+	completed_requests_[r] = true;
+	return r;
+}
+
+void LibcameraApp::recycleCompletedRequest(CompletedRequest *completed_request)
+{
+	std::lock_guard<std::mutex> lock(completed_requests_mutex_);
+	free_completed_requests_.push_back(completed_request);
+}
+
 void LibcameraApp::previewDoneCallback(int fd)
 {
 	std::lock_guard<std::mutex> lock(preview_mutex_);
 	auto it = preview_completed_requests_.find(fd);
-	if (it == preview_completed_requests_.end())
+	if (it == preview_completed_requests_.end() || !it->second)
 		throw std::runtime_error("previewDoneCallback: missing fd " + std::to_string(fd));
-	preview_completed_requests_.erase(it); // drop shared_ptr reference
+	it->second.reset(); // drop shared_ptr reference, but keep the map entry for next time
 }
 
 void LibcameraApp::startPreview()
@@ -805,8 +1156,14 @@ void LibcameraApp::previewThread()
 			msg_queue_.Post(Msg(MsgType::Quit));
 		}
 		preview_frames_displayed_++;
-		preview_->Show(fd, span, info);
-		if (!options_->info_text.empty())
+		if (preview_->CpuAccess())
+		{
+			BufferReadSync sync(this, buffer, true);
+			preview_->Show(fd, sync.Get()[0], info);
+		}
+		else
+			preview_->Show(fd, span, info);
+		if (!options_->info_text.empty() && !options_->nopreview)
 		{
 			std::string s = frame_info.ToString(options_->info_text);
 			preview_->SetInfoText(s);
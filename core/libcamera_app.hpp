@@ -9,8 +9,11 @@
 
 #include <sys/mman.h>
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <queue>
@@ -30,6 +33,7 @@
 
 #include "core/completed_request.hpp"
 #include "core/post_processor.hpp"
+#include "core/recycling_queue.hpp"
 #include "core/stream_info.hpp"
 
 struct Options;
@@ -73,6 +77,17 @@ public:
 		MsgPayload payload;
 	};
 
+	// Reasons for which frames get lost.
+	enum class DropCause
+	{
+		Sensor, // sensor/ISP, even though we had requests queued
+		NoRequest, // no request was queued with the camera
+		PostProcessor, // post-processing was holding all the buffers
+		Encoder, // encoder input was full
+		Output, // output could not keep up
+		NumCauses
+	};
+
 	// Some flags that can be used to give hints to the camera configuration.
 	static constexpr unsigned int FLAG_STILL_NONE = 0;
 	static constexpr unsigned int FLAG_STILL_BGR = 1; // supply BGR images, not YUV
@@ -114,14 +129,28 @@ public:
 	Stream *LoresStream(StreamInfo *info = nullptr) const;
 	Stream *GetMainStream() const;
 
-	std::vector<libcamera::Span<uint8_t>> Mmap(FrameBuffer *buffer) const;
+	std::vector<libcamera::Span<uint8_t>> const &Mmap(FrameBuffer *buffer) const;
+	// Whether CPU reads from this buffer's mapping were measured to be slow (uncached).
+	bool SlowMapping(FrameBuffer *buffer) const { return slow_buffers_.count(buffer); }
 
 	void ShowPreview(CompletedRequestPtr &completed_request, Stream *stream);
 
 	void SetControls(ControlList &controls);
+	// Convert a region of interest, given as fractions of the sensor, to a ScalerCrop.
+	libcamera::Rectangle RoiToScalerCrop(float x, float y, float width, float height) const;
+	// Turn a post-processing stage on or off, from the next frame.
+	void EnablePostProcessingStage(std::string const &name, bool enable);
+	ControlList CarryControls(ControlList const &metadata, float exposure_scale) const;
+	void SetBracketControls(std::vector<ControlList> const &brackets);
+	void RecordDrop(DropCause cause, unsigned int count = 1);
+	uint64_t GetDrops(DropCause cause) const { return drops_[(unsigned int)cause]; }
 	StreamInfo GetStreamInfo(Stream const *stream) const;
 
 protected:
+	// Say why the camera ran out of requests. Derived classes that hold on to
+	// completed requests can override this to implicate themselves.
+	virtual DropCause starvationCause();
+
 	std::unique_ptr<Options> options_;
 
 private:
@@ -140,18 +169,16 @@ private:
 		{
 			std::unique_lock<std::mutex> lock(mutex_);
 			cond_.wait(lock, [this] { return !queue_.empty(); });
-			T msg = std::move(queue_.front());
-			queue_.pop();
-			return msg;
+			return queue_.pop_front();
 		}
 		void Clear()
 		{
 			std::unique_lock<std::mutex> lock(mutex_);
-			queue_ = {};
+			queue_.clear();
 		}
 
 	private:
-		std::queue<T> queue_;
+		RecyclingQueue<T> queue_;
 		std::mutex mutex_;
 		std::condition_variable cond_;
 	};
@@ -173,12 +200,16 @@ private:
 	void setupCapture();
 	void makeRequests();
 	void queueRequest(CompletedRequest *completed_request);
+	CompletedRequest *getCompletedRequest(Request *request);
+	void recycleCompletedRequest(CompletedRequest *completed_request);
 	void requestComplete(Request *request);
 	void previewDoneCallback(int fd);
 	void startPreview();
 	void stopPreview();
 	void previewThread();
 	void configureDenoise(const std::string &denoise_mode);
+	void applyBracketControls(Request *request);
+	void tagBracketFrame(Request *request, CompletedRequest *completed_request);
 
 	std::unique_ptr<CameraManager> camera_manager_;
 	std::shared_ptr<Camera> camera_;
@@ -190,7 +221,9 @@ private:
 	std::map<Stream *, std::queue<FrameBuffer *>> frame_buffers_;
 	std::vector<std::unique_ptr<Request>> requests_;
 	std::mutex completed_requests_mutex_;
-	std::set<CompletedRequest *> completed_requests_;
+	std::map<CompletedRequest *, bool> completed_requests_; // true while "live"
+	std::vector<std::unique_ptr<CompletedRequest>> completed_request_pool_;
+	std::vector<CompletedRequest *> free_completed_requests_;
 	bool camera_started_ = false;
 	std::mutex camera_stop_mutex_;
 	MessageQueue<Msg> msg_queue_;
@@ -208,8 +241,34 @@ private:
 	// For setting camera controls.
 	std::mutex control_mutex_;
 	ControlList controls_;
+	std::queue<std::pair<unsigned int, ControlList>> bracket_controls_;
+	std::map<Request *, unsigned int> bracket_requests_;
+	// The exposure each bracket is waiting to see in the frame metadata.
+	struct BracketTarget
+	{
+		unsigned int index;
+		int32_t exposure_time; // 0 if not set
+		float analogue_gain; // 0 if not set
+		unsigned int frames_waited;
+	};
+	std::queue<BracketTarget> bracket_targets_;
+	unsigned int brackets_applied_ = 0; // how many brackets' requests have completed
+	// Drop accounting.
+	std::mutex starvation_mutex_;
+	unsigned int requests_in_flight_ = 0;
+	std::chrono::steady_clock::time_point dry_since_; // when the camera last ran out of requests
+	std::chrono::duration<double> dry_time_ {}; // time without requests since the last frame
+	DropCause dry_cause_ = DropCause::NoRequest; // who was holding the requests then
+	uint64_t last_sensor_timestamp_ = 0;
+	bool sensor_sequence_valid_ = false;
+	uint32_t last_sensor_sequence_ = 0;
+	std::atomic<uint64_t> drops_[(unsigned int)DropCause::NumCauses] = {};
 	// Other:
 	uint64_t last_timestamp_;
+	std::vector<std::string> dmabuf_owners_;
+	std::map<std::string, bool> measured_streams_; // stream configurations measured, and whether slow
+	std::set<FrameBuffer *> slow_buffers_; // CPU reads of these mappings are slow
+	std::chrono::steady_clock::time_point last_memory_report_;
 	uint64_t sequence_ = 0;
 	PostProcessor post_processor_;
 };
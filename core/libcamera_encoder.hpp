@@ -5,6 +5,10 @@
  * libcamera_encoder.cpp - libcamera video encoding class.
  */
 
+#include <algorithm>
+#include <map>
+#include <vector>
+
 #include "core/libcamera_app.hpp"
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
@@ -12,6 +16,11 @@
 #include "encoder/encoder.hpp"
 
 typedef std::function<void(void *, size_t, int64_t, bool)> EncodeOutputReadyCallback;
+typedef std::function<void()> EncodeResumeCallback;
+
+// Runs one or more encoders, each bound to one of the camera's streams and identified by
+// name. "video" is the main one, encoding the video stream; with --lores-codec there's a
+// "lores" one as well, encoding the low resolution stream.
 
 class LibcameraEncoder : public LibcameraApp
 {
@@ -24,14 +33,45 @@ public:
 	void StartEncoder()
 	{
 		createEncoder();
-		encoder_->SetInputDoneCallback(std::bind(&LibcameraEncoder::encodeBufferDone, this, std::placeholders::_1));
-		encoder_->SetOutputReadyCallback(encode_output_ready_callback_);
+		for (auto &[name, pipe] : pipes_)
+		{
+			EncodePipe *p = pipe.get();
+			p->encoder->SetInputDoneCallback([this, p](void *mem) { encodeBufferDone(*p, mem); });
+			p->encoder->SetOutputReadyCallback(
+				[p](void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+				{
+					p->output_busy = true;
+					p->output_ready_callback(mem, size, timestamp_us, keyframe);
+					p->output_busy = false;
+				});
+			if (!p->output_ready_callback)
+				throw std::runtime_error("no output for " + name + " encoder");
+		}
+	}
+	// This is callback when the named encoder gives you the encoded output data.
+	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback, std::string const &name = "video")
+	{
+		callbacks_[name] = callback;
+	}
+	// This is called when the named encoder is resumed after being suspended.
+	void SetEncodeResumeCallback(EncodeResumeCallback callback, std::string const &name = "video")
+	{
+		resume_callbacks_[name] = callback;
 	}
-	// This is callback when the encoder gives you the encoded output data.
-	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback) { encode_output_ready_callback_ = callback; }
 	void EncodeBuffer(CompletedRequestPtr &completed_request, Stream *stream)
 	{
-		assert(encoder_);
+		auto it = std::find_if(pipes_.begin(), pipes_.end(),
+							   [stream](auto const &p) { return p.second->stream == stream; });
+		if (it == pipes_.end())
+			throw std::runtime_error("no encoder for this stream");
+		EncodePipe &pipe = *it->second;
+		if (pipe.suspended)
+			return;
+		if (pipe.keyframe_needed)
+		{
+			pipe.encoder->RequestKeyframe();
+			pipe.keyframe_needed = false;
+		}
 		StreamInfo info = GetStreamInfo(stream);
 		FrameBuffer *buffer = completed_request->buffers[stream];
 		libcamera::Span span = Mmap(buffer)[0];
@@ -40,42 +80,173 @@ public:
 			throw std::runtime_error("no buffer to encode");
 		int64_t timestamp_ns = buffer->metadata().timestamp;
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			encode_buffer_queue_.push(completed_request); // creates a new reference
+			std::lock_guard<std::mutex> lock(pipe.mutex);
+			// Use a free slot if there is one, so that we don't allocate in steady state.
+			auto slot = std::find_if(pipe.encode_buffers.begin(), pipe.encode_buffers.end(),
+									 [](EncodeSlot const &b) { return !b.completed_request; });
+			if (slot == pipe.encode_buffers.end())
+				slot = pipe.encode_buffers.emplace(pipe.encode_buffers.end());
+			slot->mem = mem;
+			slot->completed_request = completed_request; // creates a new reference
+			pipe.encoding++;
 		}
-		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
+		pipe.stats->Queued(mem, timestamp_ns / 1000);
+		pipe.encoder->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
+	}
+	void SetBitrate(uint32_t bitrate, std::string const &name = "video") { getPipe(name).encoder->SetBitrate(bitrate); }
+	// Outputs may ask for keyframes while the encoder is finishing off its last frames as
+	// it closes, when it's too late to do anything about it.
+	void RequestKeyframe(std::string const &name = "video")
+	{
+		EncodePipe &pipe = getPipe(name);
+		std::lock_guard<std::mutex> lock(pipe.keyframe_mutex);
+		if (!pipe.stopping)
+			pipe.encoder->RequestKeyframe();
+	}
+	// Stop (or restart) handing frames to the named encoder, for example while nothing
+	// is being output. The first frame after restarting will be a keyframe, if the encoder
+	// can make one, and the resume callback lets the output wait for one if not.
+	void SuspendEncoder(bool suspend, std::string const &name = "video")
+	{
+		EncodePipe &pipe = getPipe(name);
+		if (suspend == pipe.suspended)
+			return;
+		pipe.suspended = suspend;
+		pipe.keyframe_needed = !suspend;
+		if (GetOptions()->verbose)
+			std::cerr << "Encoding " << (suspend ? "suspended" : "resumed") << " (" << name << ")" << std::endl;
+		if (!suspend && pipe.resume_callback)
+			pipe.resume_callback();
+	}
+	EncoderStats::Summary GetEncoderStats(std::string const &name = "video")
+	{
+		return getPipe(name).stats->Get();
 	}
 	VideoOptions *GetOptions() const { return static_cast<VideoOptions *>(options_.get()); }
-	void StopEncoder() { encoder_.reset(); }
+	// The options for the low resolution stream's encoder and output, where it has one.
+	VideoOptions const *GetLoresOptions()
+	{
+		if (!lores_options_)
+			lores_options_ = std::make_unique<VideoOptions>(GetOptions()->LoresOptions());
+		return lores_options_.get();
+	}
+	void StopEncoder()
+	{
+		for (auto &[name, pipe] : pipes_)
+		{
+			{
+				std::lock_guard<std::mutex> lock(pipe->keyframe_mutex);
+				pipe->stopping = true;
+			}
+			pipe->encoder.reset();
+			// Closing the encoder finishes off (or loses) its last frames, which the stats now include.
+			uint64_t dropped = pipe->stats->Get().dropped;
+			if (GetOptions()->verbose)
+				pipe->stats->Print(name);
+			if (dropped)
+				RecordDrop(DropCause::Encoder, dropped);
+		}
+		pipes_.clear();
+	}
 
 protected:
+	// When we're holding most of the buffers, it's the encoder (or the output that it's
+	// waiting for) that has starved the camera.
+	DropCause starvationCause() override
+	{
+		bool encoding = false, output_busy = false;
+		for (auto &[name, pipe] : pipes_)
+		{
+			std::lock_guard<std::mutex> lock(pipe->mutex);
+			encoding |= pipe->encoding > 0;
+			output_busy |= pipe->encoding && pipe->output_busy;
+		}
+		DropCause cause = LibcameraApp::starvationCause();
+		if (encoding && cause == DropCause::NoRequest)
+			return output_busy ? DropCause::Output : DropCause::Encoder;
+		return cause;
+	}
+
 	virtual void createEncoder()
 	{
 		StreamInfo info;
-		VideoStream(&info);
+		Stream *stream = VideoStream(&info);
 		if (!info.width || !info.height || !info.stride)
 			throw std::runtime_error("video steam is not configured");
-		encoder_ = std::unique_ptr<Encoder>(Encoder::Create(GetOptions(), info));
+		addEncoder("video", stream, Encoder::Create(GetOptions(), info));
+
+		if (!GetOptions()->lores_codec.empty())
+		{
+			info = {};
+			stream = LoresStream(&info);
+			if (!stream)
+				throw std::runtime_error("lores stream is not configured");
+			addEncoder("lores", stream, Encoder::Create(GetLoresOptions(), info));
+		}
+	}
+	// Bind an encoder to a stream, taking ownership of it.
+	void addEncoder(std::string const &name, Stream *stream, Encoder *encoder)
+	{
+		auto &pipe = pipes_[name];
+		pipe = std::make_unique<EncodePipe>();
+		pipe->stream = stream;
+		pipe->encoder = std::unique_ptr<Encoder>(encoder);
+		pipe->stats = encoder->Stats();
+		pipe->output_ready_callback = callbacks_[name];
+		pipe->resume_callback = resume_callbacks_[name];
 	}
-	std::unique_ptr<Encoder> encoder_;
 
 private:
-	void encodeBufferDone(void *mem)
+	// The requests whose buffers are being encoded, and the buffer memory that identifies
+	// them. Finished slots are kept (with a null request) to be re-used.
+	struct EncodeSlot
+	{
+		void *mem;
+		CompletedRequestPtr completed_request;
+	};
+	struct EncodePipe
+	{
+		Stream *stream;
+		std::unique_ptr<Encoder> encoder;
+		std::shared_ptr<EncoderStats> stats;
+		std::vector<EncodeSlot> encode_buffers;
+		size_t encoding = 0;
+		std::mutex mutex;
+		EncodeOutputReadyCallback output_ready_callback;
+		EncodeResumeCallback resume_callback;
+		std::atomic<bool> output_busy = false;
+		bool suspended = false;
+		bool keyframe_needed = false;
+		std::mutex keyframe_mutex; // only for keyframe requests, which come from the outputs
+		bool stopping = false;
+	};
+
+	EncodePipe &getPipe(std::string const &name)
+	{
+		auto it = pipes_.find(name);
+		if (it == pipes_.end())
+			throw std::runtime_error("no " + name + " encoder");
+		return *it->second;
+	}
+
+	void encodeBufferDone(EncodePipe &pipe, void *mem)
 	{
-		// If non-NULL, mem would indicate which buffer has been completed, but
-		// currently we're just assuming everything is done in order. (We could
-		// handle this by replacing the queue with a vector of <mem, completed_request>
-		// pairs.)
-		assert(mem == nullptr);
+		// The encoder tells us which buffer it's finished with, which needn't be the oldest.
+		CompletedRequestPtr completed_request;
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			if (encode_buffer_queue_.empty())
+			std::lock_guard<std::mutex> lock(pipe.mutex);
+			auto it = std::find_if(pipe.encode_buffers.begin(), pipe.encode_buffers.end(),
+								   [mem](EncodeSlot const &b) { return b.completed_request && b.mem == mem; });
+			if (it == pipe.encode_buffers.end())
 				throw std::runtime_error("no buffer available to return");
-			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			completed_request = std::move(it->completed_request);
+			pipe.encoding--;
 		}
+		// Drop our reference outside the lock, as that may recycle the request.
 	}
 
-	std::queue<CompletedRequestPtr> encode_buffer_queue_;
-	std::mutex encode_buffer_queue_mutex_;
-	EncodeOutputReadyCallback encode_output_ready_callback_;
+	std::map<std::string, std::unique_ptr<EncodePipe>> pipes_;
+	std::map<std::string, EncodeOutputReadyCallback> callbacks_;
+	std::map<std::string, EncodeResumeCallback> resume_callbacks_;
+	std::unique_ptr<VideoOptions> lores_options_;
 };
@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * memory_report.cpp - report who is holding the big chunks of memory.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "core/memory_report.hpp"
+
+static std::mutex mutex;
+static std::map<std::string, size_t> owners;
+static std::vector<std::pair<std::string, size_t>> phases; // peak RSS in each phase, in order
+static std::string current_phase;
+
+// Return the given field, in kB, from /proc/self/status.
+static size_t read_status(std::string const &field)
+{
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line))
+	{
+		if (line.compare(0, field.size() + 1, field + ":") == 0)
+			return std::stoul(line.substr(field.size() + 1));
+	}
+	return 0;
+}
+
+// Writing 5 to clear_refs resets the peak RSS to the current RSS.
+static void reset_peak_rss()
+{
+	static bool warned = false;
+	std::ofstream clear_refs("/proc/self/clear_refs");
+	clear_refs << "5" << std::flush;
+	if (!clear_refs && !warned)
+	{
+		std::cerr << "WARNING: unable to reset peak RSS, phase peaks will be cumulative" << std::endl;
+		warned = true;
+	}
+}
+
+static void end_phase()
+{
+	if (current_phase.empty())
+		return;
+	size_t peak = read_status("VmHWM");
+	for (auto &p : phases)
+	{
+		if (p.first == current_phase)
+		{
+			p.second = std::max(p.second, peak);
+			return;
+		}
+	}
+	phases.emplace_back(current_phase, peak);
+}
+
+void memory_report_set(std::string const &owner, size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (bytes)
+		owners[owner] = bytes;
+	else
+		owners.erase(owner);
+}
+
+void memory_report_phase(std::string const &phase)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (phase == current_phase)
+		return;
+	end_phase();
+	reset_peak_rss();
+	current_phase = phase;
+}
+
+static std::string megabytes(size_t bytes)
+{
+	std::stringstream s;
+	s.precision(1);
+	s << std::fixed << bytes / (double)(1 << 20) << "MB";
+	return s.str();
+}
+
+void memory_report_print(std::string const &title)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t total = 0;
+	std::cerr << "Memory report (" << title << "):" << std::endl;
+	for (auto const &p : owners)
+	{
+		std::cerr << "    " << p.first << ": " << megabytes(p.second) << std::endl;
+		total += p.second;
+	}
+	std::cerr << "    total: " << megabytes(total) << std::endl;
+
+	// Record the current phase's peak so far, without ending it.
+	end_phase();
+	std::cerr << "    peak RSS:";
+	for (auto const &p : phases)
+		std::cerr << " " << p.first << " " << megabytes(p.second << 10);
+	std::cerr << std::endl;
+	std::cerr << "    RSS now: " << megabytes(read_status("VmRSS") << 10) << std::endl;
+}
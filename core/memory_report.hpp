@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * memory_report.hpp - report who is holding the big chunks of memory.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// Anything that holds on to a large amount of memory (camera buffers, encoder
+// buffers, stage working images and so on) records how much under an owner name.
+// Setting an owner's size to zero removes it. The memory use is also split into
+// "phases" (such as "configure" or "running") so that we can see the peak RSS
+// during each one.
+
+void memory_report_set(std::string const &owner, size_t bytes);
+void memory_report_phase(std::string const &phase);
+void memory_report_print(std::string const &title);
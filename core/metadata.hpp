@@ -94,6 +94,15 @@ public:
 		data_.insert_or_assign(tag, std::forward<T>(value));
 	}
 
+	template <typename F>
+	void ForEach(F &&fn) const
+	{
+		// Calls fn(tag, value) for every item, holding the lock throughout.
+		std::scoped_lock lock(mutex_);
+		for (auto const &item : data_)
+			fn(item.first, item.second);
+	}
+
 	// Note: use of (lowercase) lock and unlock means you can create scoped
 	// locks with the standard lock classes.
 	// e.g. std::lock_guard<RPiController::Metadata> lock(metadata)
@@ -56,6 +56,7 @@ bool Options::Parse(int argc, char *argv[])
 		store(parse_config_file(ifs, options_), vm);
 		notify(vm);
 	}
+	timeout_given = !vm["timeout"].defaulted();
 
 	if (help)
 	{
@@ -136,6 +137,9 @@ bool Options::Parse(int argc, char *argv[])
 	if (!!(transform & Transform::Transpose))
 		throw std::runtime_error("transforms requiring transpose not supported");
 
+	if (post_process_reload && post_process_file.empty())
+		throw std::runtime_error("post-process-reload needs a post-process-file");
+
 	if (sscanf(roi.c_str(), "%f,%f,%f,%f", &roi_x, &roi_y, &roi_width, &roi_height) != 4)
 		roi_x = roi_y = roi_width = roi_height = 0; // don't set digital zoom
 
@@ -204,6 +208,8 @@ void Options::Print() const
 	std::cerr << "    height: " << height << std::endl;
 	std::cerr << "    output: " << output << std::endl;
 	std::cerr << "    post_process_file: " << post_process_file << std::endl;
+	if (post_process_reload)
+		std::cerr << "    post_process_reload: " << post_process_reload << std::endl;
 	std::cerr << "    rawfull: " << rawfull << std::endl;
 	if (nopreview)
 		std::cerr << "    preview: none" << std::endl;
@@ -246,4 +252,8 @@ void Options::Print() const
 
 	std::cerr << "    mode: " << mode.ToString() << std::endl;
 	std::cerr << "    viewfinder-mode: " << viewfinder_mode.ToString() << std::endl;
+	if (memory_report >= 0)
+		std::cerr << "    memory-report: " << memory_report << std::endl;
+	if (alloc_audit)
+		std::cerr << "    alloc-audit: " << alloc_audit << std::endl;
 }
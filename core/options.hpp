@@ -69,6 +69,8 @@ struct Options
 			 "Set the output file name")
 			("post-process-file", value<std::string>(&post_process_file),
 			 "Set the file name for configuring the post-processing")
+			("post-process-reload", value<bool>(&post_process_reload)->default_value(false)->implicit_value(true),
+			 "Reload the post-processing file whenever it changes, without stopping the camera")
 			("rawfull", value<bool>(&rawfull)->default_value(false)->implicit_value(true),
 			 "Force use of full resolution raw frames")
 			("nopreview,n", value<bool>(&nopreview)->default_value(false)->implicit_value(true),
@@ -129,6 +131,10 @@ struct Options
 			 "Camera mode as W:H:bit-depth:packing, where packing is P (packed) or U (unpacked)")
 			("viewfinder-mode", value<std::string>(&viewfinder_mode_string),
 			 "Camera mode for preview as W:H:bit-depth:packing, where packing is P (packed) or U (unpacked)")
+			("memory-report", value<int>(&memory_report)->default_value(-1)->implicit_value(0),
+			 "Report memory use at startup and exit, and also every this many seconds if given")
+			("alloc-audit", value<unsigned int>(&alloc_audit)->default_value(0),
+			 "Count heap allocations made after this many warm-up frames (needs ENABLE_ALLOC_AUDIT)")
 			;
 		// clang-format on
 	}
@@ -140,9 +146,11 @@ struct Options
 	bool list_cameras;
 	bool verbose;
 	uint64_t timeout; // in ms
+	bool timeout_given; // rather than defaulted
 	std::string config_file;
 	std::string output;
 	std::string post_process_file;
+	bool post_process_reload;
 	unsigned int width;
 	unsigned int height;
 	bool rawfull;
@@ -185,6 +193,8 @@ struct Options
 	Mode mode;
 	std::string viewfinder_mode_string;
 	Mode viewfinder_mode;
+	int memory_report;
+	unsigned int alloc_audit;
 
 	virtual bool Parse(int argc, char *argv[]);
 	virtual void Print() const;
@@ -5,8 +5,15 @@
  * post_processor.cpp - Post processor implementation.
  */
 
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
 #include <iostream>
 
+#include "core/executor.hpp"
 #include "core/libcamera_app.hpp"
 #include "core/post_processor.hpp"
 
@@ -15,16 +22,30 @@
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
 
-PostProcessor::PostProcessor(LibcameraApp *app) : app_(app)
+PostProcessor::PostProcessor(LibcameraApp *app)
+	: app_(app), stages_(std::make_shared<StageList>()), enabled_stages_(~(uint64_t)0), configured_(false),
+	  started_(false), inotify_fd_(-1), watch_event_fd_(-1)
 {
 }
 
 PostProcessor::~PostProcessor()
 {
+	if (watch_thread_.joinable())
+	{
+		uint64_t value = 1;
+		if (write(watch_event_fd_, &value, sizeof(value)) != sizeof(value))
+			std::cerr << "WARNING: failed to stop post-processing file watcher" << std::endl;
+		watch_thread_.join();
+	}
+	if (inotify_fd_ >= 0)
+		close(inotify_fd_);
+	if (watch_event_fd_ >= 0)
+		close(watch_event_fd_);
 }
 
-void PostProcessor::Read(std::string const &filename)
+std::shared_ptr<StageList> PostProcessor::readStages(std::string const &filename)
 {
+	auto stages = std::make_shared<StageList>();
 	boost::property_tree::ptree root;
 	boost::property_tree::read_json(filename, root);
 	for (auto const &key_and_value : root)
@@ -33,12 +54,147 @@ void PostProcessor::Read(std::string const &filename)
 		if (stage)
 		{
 			std::cerr << "Reading post processing stage \"" << key_and_value.first << "\"" << std::endl;
+			stages->push_back(StagePtr(stage));
 			stage->Read(key_and_value.second);
-			stages_.push_back(StagePtr(stage));
+			if (stages->size() > 64)
+				throw std::runtime_error("too many post processing stages");
 		}
 		else
 			std::cerr << "No post processing stage found for \"" << key_and_value.first << "\"" << std::endl;
 	}
+	return stages;
+}
+
+void PostProcessor::Read(std::string const &filename)
+{
+	std::lock_guard<std::mutex> state_lock(state_mutex_);
+	std::shared_ptr<StageList> stages = readStages(filename);
+	std::unique_lock<std::mutex> l(mutex_);
+	stages_ = std::move(stages);
+	enabled_stages_ = ~(uint64_t)0;
+}
+
+void PostProcessor::Watch(std::string const &filename)
+{
+	// Watch the directory rather than the file, as editors often replace the file.
+	size_t slash = filename.find_last_of('/');
+	std::string dir = slash == std::string::npos ? "." : filename.substr(0, slash + 1);
+
+	inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd_ < 0)
+		throw std::runtime_error("failed to create inotify instance");
+	if (inotify_add_watch(inotify_fd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+		throw std::runtime_error("failed to watch " + dir + " for post-processing file changes");
+	watch_event_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (watch_event_fd_ < 0)
+		throw std::runtime_error("failed to create eventfd");
+
+	watch_thread_ = std::thread(&PostProcessor::watchThread, this, filename);
+}
+
+void PostProcessor::watchThread(std::string filename)
+{
+	size_t slash = filename.find_last_of('/');
+	std::string name = slash == std::string::npos ? filename : filename.substr(slash + 1);
+
+	while (true)
+	{
+		// While there are old stages waiting to go, keep checking if they're finished with.
+		bool retiring;
+		{
+			std::lock_guard<std::mutex> state_lock(state_mutex_);
+			retiring = !retired_stages_.empty();
+		}
+		pollfd fds[2] = { { inotify_fd_, POLLIN, 0 }, { watch_event_fd_, POLLIN, 0 } };
+		if (poll(fds, 2, retiring ? 100 : -1) < 0 && errno != EINTR)
+		{
+			std::cerr << "ERROR: post-processing file watcher failed, errno " << errno << std::endl;
+			return;
+		}
+		if (fds[1].revents & POLLIN)
+			return;
+
+		bool changed = false;
+		alignas(inotify_event) char buf[4096];
+		ssize_t len;
+		while ((len = read(inotify_fd_, buf, sizeof(buf))) > 0)
+		{
+			for (char *p = buf; p < buf + len; p += sizeof(inotify_event) + ((inotify_event *)p)->len)
+			{
+				inotify_event *event = (inotify_event *)p;
+				changed |= event->len && name == event->name;
+			}
+		}
+
+		if (changed)
+		{
+			std::cerr << "Reloading post-processing file " << filename << std::endl;
+			try
+			{
+				reload(filename);
+			}
+			catch (std::exception const &e)
+			{
+				std::cerr << "ERROR: post-processing reload failed, keeping previous stages: " << e.what()
+						  << std::endl;
+			}
+		}
+		else
+		{
+			std::lock_guard<std::mutex> state_lock(state_mutex_);
+			retireStages();
+		}
+	}
+}
+
+void PostProcessor::reload(std::string const &filename)
+{
+	// Reading the file can be slow (e.g. loading models), so do that before getting the lock.
+	std::shared_ptr<StageList> stages = readStages(filename);
+
+	// Bring the new stages into the same state as the ones they replace. The camera
+	// is already configured, so there's no calling AdjustConfig now.
+	std::lock_guard<std::mutex> state_lock(state_mutex_);
+	if (configured_)
+	{
+		for (auto &stage : *stages)
+			stage->Configure();
+	}
+	if (started_)
+	{
+		for (auto &stage : *stages)
+			stage->Start();
+	}
+
+	{
+		std::unique_lock<std::mutex> l(mutex_);
+		std::swap(stages, stages_);
+		enabled_stages_ = ~(uint64_t)0;
+	}
+	retired_stages_.push_back(std::move(stages));
+	retireStages();
+	std::cerr << "Post-processing file reloaded" << std::endl;
+}
+
+// Stop and delete old stages, once no more requests are using them. Needs the state_mutex_.
+void PostProcessor::retireStages()
+{
+	for (auto it = retired_stages_.begin(); it != retired_stages_.end();)
+	{
+		if (it->use_count() > 1)
+		{
+			it++;
+			continue;
+		}
+		for (auto &stage : **it)
+		{
+			if (started_)
+				stage->Stop();
+			if (configured_)
+				stage->Teardown();
+		}
+		it = retired_stages_.erase(it);
+	}
 }
 
 PostProcessingStage *PostProcessor::createPostProcessingStage(char const *name)
@@ -54,7 +210,8 @@ void PostProcessor::SetCallback(PostProcessorCallback callback)
 
 void PostProcessor::AdjustConfig(std::string const &use_case, StreamConfiguration *config)
 {
-	for (auto &stage : stages_)
+	std::lock_guard<std::mutex> state_lock(state_mutex_);
+	for (auto &stage : *stages_)
 	{
 		stage->AdjustConfig(use_case, config);
 	}
@@ -62,53 +219,73 @@ void PostProcessor::AdjustConfig(std::string const &use_case, StreamConfiguratio
 
 void PostProcessor::Configure()
 {
-	for (auto &stage : stages_)
+	std::lock_guard<std::mutex> state_lock(state_mutex_);
+	for (auto &stage : *stages_)
 	{
 		stage->Configure();
 	}
+	configured_ = true;
 }
 
 void PostProcessor::Start()
 {
+	std::lock_guard<std::mutex> state_lock(state_mutex_);
 	quit_ = false;
 	output_thread_ = std::thread(&PostProcessor::outputThread, this);
 
-	for (auto &stage : stages_)
+	for (auto &stage : *stages_)
 	{
 		stage->Start();
 	}
+	started_ = true;
 }
 
 void PostProcessor::Process(CompletedRequestPtr &request)
 {
-	if (stages_.empty())
+	std::unique_lock<std::mutex> l(mutex_);
+
+	// With no stages we can skip the queue, but not if that would overtake requests
+	// still going through stages that have just been replaced.
+	if (stages_->empty() && futures_.empty())
 	{
+		l.unlock();
 		callback_(request);
 		return;
 	}
 
-	std::unique_lock<std::mutex> l(mutex_);
 	requests_.push(std::move(request)); // caller has given us ownership of this reference
 
-	std::promise<bool> promise;
-	auto process_fn = [this](CompletedRequestPtr &request, std::promise<bool> promise) {
+	// The task must be copyable, so the promise is held by a shared_ptr.
+	auto promise = std::make_shared<std::promise<bool>>();
+	// Take a copy of the stages and which are enabled, so that changes only happen between requests.
+	auto process_fn = [this, stages = stages_, enabled = enabled_stages_, &request = requests_.back(),
+					   promise]() mutable {
 		bool drop_request = false;
-		for (auto &stage : stages_)
+		for (unsigned int i = 0; i < stages->size(); i++)
 		{
-			if (stage->Process(request))
+			if ((enabled & ((uint64_t)1 << i)) && (*stages)[i]->Process(request))
 			{
 				drop_request = true;
 				break;
 			}
 		}
-		promise.set_value(drop_request);
+		stages.reset(); // so that retired stages are finished with before the request is
+		promise->set_value(drop_request);
+		// Taking the lock stops the output thread missing this between checking and waiting.
+		std::lock_guard<std::mutex> l(mutex_);
 		cv_.notify_one();
 	};
 
 	// Queue the futures to ensure we have correct ordering in the output thread. The promise/future return value
 	// tells us when all the streams for this request have been processed and output_ready_callback_ can be called.
-	futures_.push(promise.get_future());
-	std::thread { process_fn, std::ref(requests_.back()), std::move(promise) }.detach();
+	futures_.push(promise->get_future());
+	Executor::Get().Post(Executor::CAPTURE, std::move(process_fn));
+}
+
+unsigned int PostProcessor::Backlog()
+{
+	std::unique_lock<std::mutex> l(mutex_);
+	return requests_.size();
 }
 
 void PostProcessor::outputThread()
@@ -141,9 +318,27 @@ void PostProcessor::outputThread()
 	}
 }
 
+void PostProcessor::EnableStage(std::string const &name, bool enable)
+{
+	std::unique_lock<std::mutex> l(mutex_);
+	bool found = false;
+	for (unsigned int i = 0; i < stages_->size(); i++)
+	{
+		if (name == (*stages_)[i]->Name())
+		{
+			uint64_t bit = (uint64_t)1 << i;
+			enabled_stages_ = enable ? (enabled_stages_ | bit) : (enabled_stages_ & ~bit);
+			found = true;
+		}
+	}
+	if (!found)
+		throw std::runtime_error("no post processing stage \"" + name + "\"");
+}
+
 void PostProcessor::Stop()
 {
-	for (auto &stage : stages_)
+	std::lock_guard<std::mutex> state_lock(state_mutex_);
+	for (auto &stage : *stages_)
 	{
 		stage->Stop();
 	}
@@ -155,12 +350,18 @@ void PostProcessor::Stop()
 	}
 
 	output_thread_.join();
+
+	// All requests are finished with now, so any retired stages can go.
+	retireStages();
+	started_ = false;
 }
 
 void PostProcessor::Teardown()
 {
-	for (auto &stage : stages_)
+	std::lock_guard<std::mutex> state_lock(state_mutex_);
+	for (auto &stage : *stages_)
 	{
 		stage->Teardown();
 	}
+	configured_ = false;
 }
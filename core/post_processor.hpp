@@ -11,7 +11,11 @@
 #include <condition_variable>
 #include <future>
 #include <mutex>
+#include <memory>
 #include <queue>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "core/completed_request.hpp"
 
@@ -27,6 +31,7 @@ class PostProcessingStage;
 using PostProcessorCallback = std::function<void(CompletedRequestPtr &)>;
 using StreamConfiguration = libcamera::StreamConfiguration;
 typedef std::unique_ptr<PostProcessingStage> StagePtr;
+typedef std::vector<StagePtr> StageList;
 
 class PostProcessor
 {
@@ -37,6 +42,11 @@ public:
 
 	void Read(std::string const &filename);
 
+	// Watch the file, and whenever it changes replace all the stages with new ones
+	// read from it. The new stages are created, configured and started away from the
+	// frame processing, and swapped in between one request and the next.
+	void Watch(std::string const &filename);
+
 	void SetCallback(PostProcessorCallback callback);
 
 	void AdjustConfig(std::string const &use_case, StreamConfiguration *config);
@@ -47,17 +57,39 @@ public:
 
 	void Process(CompletedRequestPtr &request);
 
+	// Number of requests currently being held by the post-processing stages.
+	unsigned int Backlog();
+
+	// Disabled stages are skipped, starting with the next request that arrives.
+	void EnableStage(std::string const &name, bool enable);
+
 	void Stop();
 
 	void Teardown();
 
 private:
 	PostProcessingStage *createPostProcessingStage(char const *name);
+	std::shared_ptr<StageList> readStages(std::string const &filename);
+	void reload(std::string const &filename);
+	void retireStages();
+	void watchThread(std::string filename);
 
 	LibcameraApp *app_;
-	std::vector<StagePtr> stages_;
+	// Requests being processed hold a reference to the stages they're using, so
+	// replaced stages are "retired" until those requests are finished.
+	std::shared_ptr<StageList> stages_;
+	std::vector<std::shared_ptr<StageList>> retired_stages_;
+	uint64_t enabled_stages_; // bit mask, one bit per stage
 	void outputThread();
 
+	// This stops reloads racing with the application configuring/starting/stopping us.
+	std::mutex state_mutex_;
+	bool configured_;
+	bool started_;
+	std::thread watch_thread_;
+	int inotify_fd_;
+	int watch_event_fd_;
+
 	std::queue<CompletedRequestPtr> requests_;
 	std::queue<std::future<bool>> futures_;
 	std::thread output_thread_;
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * recycling_queue.hpp - FIFO queue that doesn't allocate in steady state.
+ */
+
+#pragma once
+
+#include <list>
+#include <utility>
+
+// A FIFO queue that keeps hold of its list nodes when items are popped, so once it
+// has grown to its working size, pushing and popping no longer allocate memory
+// (unlike std::queue, whose std::deque allocates and frees blocks as it goes).
+// Popped items are moved out, so the nodes kept back don't hold on to anything.
+// There is no locking; callers provide their own.
+
+template <typename T>
+class RecyclingQueue
+{
+public:
+	template <typename U>
+	void push(U &&item)
+	{
+		if (free_.empty())
+			queue_.push_back(std::forward<U>(item));
+		else
+		{
+			free_.front() = std::forward<U>(item);
+			queue_.splice(queue_.end(), free_, free_.begin());
+		}
+	}
+	T &front() { return queue_.front(); }
+	T pop_front()
+	{
+		T item = std::move(queue_.front());
+		free_.splice(free_.end(), queue_, queue_.begin());
+		return item;
+	}
+	void pop() { pop_front(); }
+	// Move out the first item that pred accepts, if there is one.
+	template <typename P>
+	bool pop_first_if(P &&pred, T &item)
+	{
+		for (auto it = queue_.begin(); it != queue_.end(); ++it)
+		{
+			if (pred(*it))
+			{
+				item = std::move(*it);
+				free_.splice(free_.end(), queue_, it);
+				return true;
+			}
+		}
+		return false;
+	}
+	bool empty() const { return queue_.empty(); }
+	size_t size() const { return queue_.size(); }
+	void clear()
+	{
+		queue_.clear();
+		free_.clear();
+	}
+
+private:
+	std::list<T> queue_;
+	std::list<T> free_;
+};
@@ -8,6 +8,7 @@
 #pragma once
 
 #include <cstdio>
+#include <sstream>
 
 #include "options.hpp"
 
@@ -46,6 +47,14 @@ struct StillOptions : public Options
 			 "Create a symbolic link with this name to most recent saved file")
 			("immediate", value<bool>(&immediate)->default_value(false)->implicit_value(true),
 			 "Perform first capture immediately, with no preview phase")
+			("carry-exposure", value<float>(&carry_exposure)->default_value(0)->implicit_value(1.0),
+			 "Start the still capture with the viewfinder's exposure and colour gains, scaling the exposure "
+			 "time by this factor (0 to disable)")
+			("bracket", value<std::string>(&bracket),
+			 "Capture an exposure bracket with these comma-separated EV offsets, e.g. -2,0,2")
+			("server", value<std::string>(&server),
+			 "Keep the camera running and capture on commands received on this Unix domain socket. The "
+			 "server runs until told to quit, unless a timeout is given explicitly")
 			;
 		// clang-format on
 	}
@@ -65,6 +74,10 @@ struct StillOptions : public Options
 	bool raw;
 	std::string latest;
 	bool immediate;
+	float carry_exposure;
+	std::string bracket;
+	std::vector<float> bracket_ev;
+	std::string server;
 
 	virtual bool Parse(int argc, char *argv[]) override
 	{
@@ -72,6 +85,25 @@ struct StillOptions : public Options
 			return false;
 		if ((keypress || signal) && timelapse)
 			throw std::runtime_error("keypress/signal and timelapse options are mutually exclusive");
+		if (!server.empty() && (keypress || signal || timelapse))
+			throw std::runtime_error("server mode cannot be used with keypress/signal or timelapse");
+		if (!server.empty() && !timeout_given)
+			timeout = 0;
+		if (!bracket.empty())
+		{
+			std::stringstream ss(bracket);
+			for (std::string ev; std::getline(ss, ev, ',');)
+			{
+				char *end;
+				bracket_ev.push_back(strtof(ev.c_str(), &end));
+				if (end == ev.c_str())
+					throw std::runtime_error("bad bracket EV value " + ev);
+			}
+			if (immediate || !server.empty())
+				throw std::runtime_error("bracket needs a viewfinder phase, so cannot be used with immediate or server");
+		}
+		if (carry_exposure < 0)
+			throw std::runtime_error("carry-exposure factor must not be negative");
 		if (strcasecmp(thumb.c_str(), "none") == 0)
 			thumb_quality = 0;
 		else if (sscanf(thumb.c_str(), "%u:%u:%u", &thumb_width, &thumb_height, &thumb_quality) != 3)
@@ -108,6 +140,9 @@ struct StillOptions : public Options
 		std::cerr << "    thumbnail quality: " << thumb_quality << std::endl;
 		std::cerr << "    latest: " << latest << std::endl;
 		std::cerr << "    immediate " << immediate << std::endl;
+		std::cerr << "    carry exposure: " << carry_exposure << std::endl;
+		std::cerr << "    bracket: " << bracket << std::endl;
+		std::cerr << "    server: " << server << std::endl;
 		for (auto &s : exif)
 			std::cerr << "    EXIF: " << s << std::endl;
 	}
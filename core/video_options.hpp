@@ -10,6 +10,7 @@
 #include <cstdio>
 
 #include <string>
+#include <thread>
 
 #include "options.hpp"
 
@@ -23,21 +24,51 @@ struct VideoOptions : public Options
 		// clang-format off
 		options_.add_options()
 			("bitrate,b", value<uint32_t>(&bitrate)->default_value(0),
-			 "Set the bitrate for encoding, in bits/second (h264 only)")
+			 "Set the bitrate for encoding, in bits/second (h264, libav and mjpeg, where it overrides quality)")
 			("profile", value<std::string>(&profile),
-			 "Set the encoding profile (h264 only)")
+			 "Set the encoding profile (h264 and libav only)")
 			("level", value<std::string>(&level),
-			 "Set the encoding level (h264 only)")
+			 "Set the encoding level (h264 and libav only)")
 			("intra,g", value<unsigned int>(&intra)->default_value(0),
-			 "Set the intra frame period (h264 only)")
+			 "Set the intra frame period (h264 and libav only)")
 			("inline", value<bool>(&inline_headers)->default_value(false)->implicit_value(true),
 			 "Force PPS/SPS header with every I frame (h264 only)")
 			("codec", value<std::string>(&codec)->default_value("h264"),
-			 "Set the codec to use, either h264, mjpeg or yuv420")
+			 "Set the codec to use, either h264, mjpeg, yuv420, libav (a software encoder) or fwht (for testing "
+			 "with the vicodec driver)")
 			("save-pts", value<std::string>(&save_pts),
 			 "Save a timestamp file with this name")
+			("save-metadata", value<std::string>(&save_metadata),
+			 "Save per-frame metadata to a binary file with this name (see utils/metadata_reader.py)")
 			("quality,q", value<int>(&quality)->default_value(50),
 			 "Set the MJPEG quality parameter (mjpeg only)")
+			("mjpeg-threads", value<unsigned int>(&mjpeg_threads)->default_value(0),
+			 "Set how many frames to encode at once (mjpeg only), 0 meaning one per CPU core")
+			("mjpeg-strips", value<unsigned int>(&mjpeg_strips)->default_value(1),
+			 "Split each frame into this many strips that are encoded in parallel, to reduce latency (mjpeg only)")
+			("yuv-pack", value<std::string>(&yuv_pack)->default_value("none"),
+			 "Write tightly packed i420 or nv12 images, without the stride padding, or none to write the buffers "
+			 "as they are (yuv420 only)")
+			("encoder-queue", value<unsigned int>(&encoder_queue)->default_value(2),
+			 "Set how many frames may wait for a busy encoder before frames are dropped (h264 and fwht only)")
+			("encoder-drop", value<std::string>(&encoder_drop)->default_value("oldest"),
+			 "Which frame to drop when the encoder queue is full, either oldest or newest (h264 and fwht only)")
+			("encode-gate", value<std::string>(&encode_gate),
+			 "Only encode frames while this post-processing result is true (or non-zero), such as motion_detect.result")
+			("lores-codec", value<std::string>(&lores_codec),
+			 "Also encode the low resolution stream (see lores-width and lores-height) with this codec")
+			("lores-output", value<std::string>(&lores_output),
+			 "Where to send the encoded low resolution stream, a file or network address as for output")
+			("lores-bitrate", value<uint32_t>(&lores_bitrate)->default_value(0),
+			 "Set the bitrate for encoding the low resolution stream")
+			("libav-video-codec", value<std::string>(&libav_video_codec)->default_value("libx264"),
+			 "Set the libavcodec encoder to use, such as libx264 or libx265 (libav only)")
+			("libav-preset", value<std::string>(&libav_preset)->default_value("ultrafast"),
+			 "Set the encoder preset, trading speed for compression, such as ultrafast or medium (libav only)")
+			("libav-tune", value<std::string>(&libav_tune)->default_value("zerolatency"),
+			 "Set the encoder tuning, such as zerolatency or film, or empty for none (libav only)")
+			("libav-threads", value<unsigned int>(&libav_threads)->default_value(0),
+			 "Set how many threads the encoder uses (libav only), 0 meaning it decides for itself")
 			("listen,l", value<bool>(&listen)->default_value(false)->implicit_value(true),
 			 "Listen for an incoming client network connection before sending data to the client")
 			("keypress,k", value<bool>(&keypress)->default_value(false)->implicit_value(true),
@@ -54,6 +85,9 @@ struct VideoOptions : public Options
 			 "Write output to a circular buffer of the given size (in MB) which is saved on exit")
 			("frames", value<unsigned int>(&frames)->default_value(0),
 			 "Run for the exact number of frames specified. This will override any timeout set.")
+			("control-socket", value<std::string>(&control_socket),
+			 "Listen on this Unix socket path for JSON commands to change controls, encoder and post-processing "
+			 "settings while running")
 			;
 		// clang-format on
 	}
@@ -65,7 +99,21 @@ struct VideoOptions : public Options
 	bool inline_headers;
 	std::string codec;
 	std::string save_pts;
+	std::string save_metadata;
 	int quality;
+	unsigned int mjpeg_threads;
+	unsigned int mjpeg_strips;
+	std::string encode_gate;
+	std::string lores_codec;
+	std::string lores_output;
+	uint32_t lores_bitrate;
+	std::string yuv_pack;
+	unsigned int encoder_queue;
+	std::string encoder_drop;
+	std::string libav_video_codec;
+	std::string libav_preset;
+	std::string libav_tune;
+	unsigned int libav_threads;
 	bool listen;
 	bool keypress;
 	bool signal;
@@ -75,6 +123,7 @@ struct VideoOptions : public Options
 	uint32_t segment;
 	size_t circular;
 	uint32_t frames;
+	std::string control_socket;
 
 	virtual bool Parse(int argc, char *argv[]) override
 	{
@@ -85,14 +134,27 @@ struct VideoOptions : public Options
 			width = 640;
 		if (height == 0)
 			height = 480;
-		if (strcasecmp(codec.c_str(), "h264") == 0)
-			codec = "h264";
-		else if (strcasecmp(codec.c_str(), "yuv420") == 0)
-			codec = "yuv420";
-		else if (strcasecmp(codec.c_str(), "mjpeg") == 0)
-			codec = "mjpeg";
+		codec = checkCodec(codec);
+		if (!lores_codec.empty())
+		{
+			lores_codec = checkCodec(lores_codec);
+			if (!lores_width || !lores_height)
+				throw std::runtime_error("lores-codec needs lores-width and lores-height");
+		}
+		if (strcasecmp(yuv_pack.c_str(), "i420") == 0)
+			yuv_pack = "i420";
+		else if (strcasecmp(yuv_pack.c_str(), "nv12") == 0)
+			yuv_pack = "nv12";
+		else if (strcasecmp(yuv_pack.c_str(), "none") != 0)
+			throw std::runtime_error("yuv-pack must be i420, nv12 or none");
 		else
-			throw std::runtime_error("unrecognised codec " + codec);
+			yuv_pack = "none";
+		if (encoder_drop != "oldest" && encoder_drop != "newest")
+			throw std::runtime_error("encoder-drop must be oldest or newest");
+		if (mjpeg_threads == 0)
+			mjpeg_threads = std::max(1u, std::thread::hardware_concurrency());
+		if (mjpeg_strips == 0)
+			throw std::runtime_error("mjpeg-strips must be at least 1");
 		if (strcasecmp(initial.c_str(), "pause") == 0)
 			pause = true;
 		else if (strcasecmp(initial.c_str(), "record") == 0)
@@ -115,13 +177,67 @@ struct VideoOptions : public Options
 		std::cerr << "    intra: " << intra << std::endl;
 		std::cerr << "    inline: " << inline_headers << std::endl;
 		std::cerr << "    save-pts: " << save_pts << std::endl;
+		if (!save_metadata.empty())
+			std::cerr << "    save-metadata: " << save_metadata << std::endl;
 		std::cerr << "    codec: " << codec << std::endl;
 		std::cerr << "    quality (for MJPEG): " << quality << std::endl;
+		std::cerr << "    mjpeg-threads: " << mjpeg_threads << std::endl;
+		std::cerr << "    mjpeg-strips: " << mjpeg_strips << std::endl;
+		if (!encode_gate.empty())
+			std::cerr << "    encode-gate: " << encode_gate << std::endl;
+		if (!lores_codec.empty())
+		{
+			std::cerr << "    lores-codec: " << lores_codec << std::endl;
+			std::cerr << "    lores-output: " << lores_output << std::endl;
+			std::cerr << "    lores-bitrate: " << lores_bitrate << std::endl;
+		}
+		if (codec == "yuv420")
+			std::cerr << "    yuv-pack: " << yuv_pack << std::endl;
+		std::cerr << "    encoder-queue: " << encoder_queue << std::endl;
+		std::cerr << "    encoder-drop: " << encoder_drop << std::endl;
+		if (codec == "libav")
+		{
+			std::cerr << "    libav-video-codec: " << libav_video_codec << std::endl;
+			std::cerr << "    libav-preset: " << libav_preset << std::endl;
+			std::cerr << "    libav-tune: " << libav_tune << std::endl;
+			std::cerr << "    libav-threads: " << libav_threads << std::endl;
+		}
 		std::cerr << "    keypress: " << keypress << std::endl;
 		std::cerr << "    signal: " << signal << std::endl;
 		std::cerr << "    initial: " << initial << std::endl;
 		std::cerr << "    split: " << split << std::endl;
 		std::cerr << "    segment: " << segment << std::endl;
 		std::cerr << "    circular: " << circular << std::endl;
+		if (!control_socket.empty())
+			std::cerr << "    control-socket: " << control_socket << std::endl;
+	}
+	// The options for encoding the low resolution stream, which are mostly the main ones.
+	VideoOptions LoresOptions() const
+	{
+		VideoOptions lores = *this;
+		lores.codec = lores_codec;
+		lores.output = lores_output;
+		lores.bitrate = lores_bitrate;
+		lores.width = lores_width;
+		lores.height = lores_height;
+		// These only apply to the main recording.
+		lores.lores_codec.clear();
+		lores.save_pts.clear();
+		lores.save_metadata.clear();
+		lores.split = false;
+		lores.segment = 0;
+		lores.circular = 0;
+		return lores;
+	}
+
+private:
+	static std::string checkCodec(std::string const &codec)
+	{
+		for (char const *name : { "h264", "yuv420", "mjpeg", "libav", "fwht" })
+		{
+			if (strcasecmp(codec.c_str(), name) == 0)
+				return name;
+		}
+		throw std::runtime_error("unrecognised codec " + codec);
 	}
 };
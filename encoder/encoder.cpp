@@ -7,10 +7,16 @@
 
 #include <cstring>
 
+#include <linux/videodev2.h>
+
 #include "encoder.hpp"
 #include "h264_encoder.hpp"
+#if LIBAV_PRESENT
+#include "libav_encoder.hpp"
+#endif
 #include "mjpeg_encoder.hpp"
 #include "null_encoder.hpp"
+#include "v4l2_encoder.hpp"
 
 Encoder *Encoder::Create(VideoOptions const *options, const StreamInfo &info)
 {
@@ -20,5 +26,15 @@ Encoder *Encoder::Create(VideoOptions const *options, const StreamInfo &info)
 		return new H264Encoder(options, info);
 	else if (strcasecmp(options->codec.c_str(), "mjpeg") == 0)
 		return new MjpegEncoder(options);
+	else if (strcasecmp(options->codec.c_str(), "fwht") == 0)
+		return new V4L2Encoder(options, info, V4L2_PIX_FMT_FWHT); // for testing with the vicodec driver
+	else if (strcasecmp(options->codec.c_str(), "libav") == 0)
+	{
+#if LIBAV_PRESENT
+		return new LibAvEncoder(options, info);
+#else
+		throw std::runtime_error("libav encoder not built in - install libavcodec-dev and rebuild");
+#endif
+	}
 	throw std::runtime_error("Unrecognised codec " + options->codec);
 }
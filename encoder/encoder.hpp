@@ -8,10 +8,14 @@
 #pragma once
 
 #include <functional>
+#include <memory>
+#include <stdexcept>
 
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
 
+#include "encoder_stats.hpp"
+
 typedef std::function<void(void *)> InputDoneCallback;
 typedef std::function<void(void *, size_t, int64_t, bool)> OutputReadyCallback;
 
@@ -20,21 +24,48 @@ class Encoder
 public:
 	static Encoder *Create(VideoOptions const *options, StreamInfo const &info);
 
-	Encoder(VideoOptions const *options) : options_(options) {}
+	Encoder(VideoOptions const *options) : options_(options), stats_(std::make_shared<EncoderStats>()) {}
 	virtual ~Encoder() {}
 	// This is where the application sets the callback it gets whenever the encoder
-	// has finished with an input buffer, so the application can re-use it.
-	void SetInputDoneCallback(InputDoneCallback callback) { input_done_callback_ = callback; }
+	// has finished with an input buffer, so the application can re-use it. The buffer
+	// is identified by the "mem" pointer it was given with, as encoders needn't finish
+	// with their buffers in order.
+	void SetInputDoneCallback(InputDoneCallback callback)
+	{
+		input_done_callback_ = [stats = stats_, callback](void *mem) {
+			stats->InputDone(mem);
+			callback(mem);
+		};
+	}
 	// This callback is how the application is told that an encoded buffer is
 	// available. The application may not hang on to the memory once it returns
 	// (but the callback is already running in its own thread).
-	void SetOutputReadyCallback(OutputReadyCallback callback) { output_ready_callback_ = callback; }
+	void SetOutputReadyCallback(OutputReadyCallback callback)
+	{
+		output_ready_callback_ = [stats = stats_, callback](void *mem, size_t size, int64_t timestamp_us,
+															bool keyframe) {
+			stats->OutputReady(timestamp_us, size, keyframe);
+			callback(mem, size, timestamp_us, keyframe);
+		};
+	}
 	// Encode the given buffer. The buffer is specified both by an fd and size
 	// describing a DMABUF, and by a mmapped userland pointer.
 	virtual void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) = 0;
+	// Change the bitrate while running, for encoders that can.
+	virtual void SetBitrate(uint32_t bitrate) { throw std::runtime_error("encoder cannot change bitrate"); }
+	// Make the next frame a keyframe. Encoders where every frame is a keyframe needn't do anything.
+	virtual void RequestKeyframe() {}
+	// Latency and size statistics. The application calls Stats()->Queued() just before
+	// EncodeBuffer(); the rest is gathered through the callbacks above, and encoders call
+	// Stats()->Dropped() for any frame they lose. The application may keep them, to see
+	// the final frames counted once the encoder has closed.
+	std::shared_ptr<EncoderStats> Stats() const { return stats_; }
 
 protected:
 	InputDoneCallback input_done_callback_;
 	OutputReadyCallback output_ready_callback_;
 	VideoOptions const *options_;
+
+private:
+	std::shared_ptr<EncoderStats> stats_;
 };
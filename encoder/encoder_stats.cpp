@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * encoder_stats.cpp - running latency and size statistics for an encoder.
+ */
+
+#include <algorithm>
+#include <iostream>
+
+#include "encoder_stats.hpp"
+
+EncoderStats::EncoderStats()
+	: in_flight_(), next_in_flight_(0), recent_(), next_recent_(0), inputs_(0), input_latency_(0),
+	  max_input_latency_(0), frames_(0), keyframes_(0), dropped_(0), outputs_(0), output_latency_(0),
+	  max_output_latency_(0), bytes_(0), keyframe_bytes_(0), max_keyframe_bytes_(0), first_timestamp_us_(0),
+	  first_bytes_(0), last_timestamp_us_(0)
+{
+	for (InFlight &frame : in_flight_)
+		frame.input_done = frame.output_done = true;
+}
+
+void EncoderStats::Queued(void *mem, int64_t timestamp_us)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	// If this overwrites a frame we never heard back about (it was dropped, perhaps), so be it.
+	in_flight_[next_in_flight_] = { mem, timestamp_us, Clock::now(), false, false };
+	next_in_flight_ = (next_in_flight_ + 1) % MAX_IN_FLIGHT;
+}
+
+void EncoderStats::InputDone(void *mem)
+{
+	Clock::time_point now = Clock::now();
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (InFlight &frame : in_flight_)
+	{
+		// Buffers get re-used, but only once the encoder has finished with them.
+		if (frame.mem == mem && !frame.input_done)
+		{
+			frame.input_done = true;
+			std::chrono::duration<double> latency = now - frame.queued;
+			input_latency_ += latency;
+			max_input_latency_ = std::max(max_input_latency_, latency);
+			inputs_++;
+			return;
+		}
+	}
+}
+
+void EncoderStats::OutputReady(int64_t timestamp_us, size_t bytes, bool keyframe)
+{
+	Clock::time_point now = Clock::now();
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (InFlight &frame : in_flight_)
+	{
+		if (frame.timestamp_us == timestamp_us && !frame.output_done)
+		{
+			frame.output_done = true;
+			std::chrono::duration<double> latency = now - frame.queued;
+			output_latency_ += latency;
+			max_output_latency_ = std::max(max_output_latency_, latency);
+			outputs_++;
+			break;
+		}
+	}
+
+	frames_++;
+	bytes_ += bytes;
+	if (keyframe)
+	{
+		keyframes_++;
+		keyframe_bytes_ += bytes;
+		max_keyframe_bytes_ = std::max(max_keyframe_bytes_, bytes);
+	}
+	if (frames_ == 1)
+	{
+		first_timestamp_us_ = timestamp_us;
+		first_bytes_ = bytes;
+	}
+	last_timestamp_us_ = timestamp_us;
+	recent_[next_recent_] = { timestamp_us, bytes };
+	next_recent_ = (next_recent_ + 1) % MAX_RECENT;
+}
+
+void EncoderStats::Dropped()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	dropped_++;
+}
+
+EncoderStats::Summary EncoderStats::Get() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	Summary summary = {};
+	summary.frames = frames_;
+	summary.keyframes = keyframes_;
+	summary.dropped = dropped_;
+	if (inputs_)
+		summary.input_latency_ms = input_latency_.count() * 1000 / inputs_;
+	summary.max_input_latency_ms = max_input_latency_.count() * 1000;
+	if (outputs_)
+		summary.output_latency_ms = output_latency_.count() * 1000 / outputs_;
+	if (frames_)
+		summary.frame_bytes = (double)bytes_ / frames_;
+	summary.max_output_latency_ms = max_output_latency_.count() * 1000;
+	if (keyframes_)
+		summary.keyframe_bytes = (double)keyframe_bytes_ / keyframes_;
+	summary.max_keyframe_bytes = max_keyframe_bytes_;
+	if (last_timestamp_us_ > first_timestamp_us_)
+		summary.average_bitrate = (bytes_ - first_bytes_) * 8e6 / (last_timestamp_us_ - first_timestamp_us_);
+
+	// The current bitrate comes from the frames in the last second. Each frame's bytes
+	// cover the interval up to its timestamp, so the oldest frame's don't count.
+	unsigned int count = std::min<uint64_t>(frames_, MAX_RECENT);
+	uint64_t bytes = 0;
+	int64_t oldest_us = last_timestamp_us_;
+	for (unsigned int i = 1; i < count; i++)
+	{
+		Recent const &frame = recent_[(next_recent_ + MAX_RECENT - 1 - i) % MAX_RECENT];
+		if (last_timestamp_us_ - frame.timestamp_us > 1000000)
+			break;
+		bytes += recent_[(next_recent_ + MAX_RECENT - i) % MAX_RECENT].bytes;
+		oldest_us = frame.timestamp_us;
+	}
+	if (last_timestamp_us_ > oldest_us)
+		summary.bitrate = bytes * 8e6 / (last_timestamp_us_ - oldest_us);
+
+	return summary;
+}
+
+void EncoderStats::Print(std::string const &name) const
+{
+	Summary s = Get();
+	std::cerr << "Encoder stats (" << name << "): " << s.frames << " frames, " << s.keyframes << " keyframes, "
+			  << s.dropped << " dropped" << std::endl;
+	std::cerr << "    input latency: average " << s.input_latency_ms << "ms, max " << s.max_input_latency_ms << "ms"
+			  << std::endl;
+	std::cerr << "    output latency: average " << s.output_latency_ms << "ms, max " << s.max_output_latency_ms << "ms"
+			  << std::endl;
+	std::cerr << "    frame size: average " << s.frame_bytes << " bytes, keyframes average " << s.keyframe_bytes
+			  << " bytes, max " << s.max_keyframe_bytes << " bytes" << std::endl;
+	std::cerr << "    bitrate: average " << s.average_bitrate << " bps, recent " << s.bitrate << " bps" << std::endl;
+}
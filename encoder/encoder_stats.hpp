@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * encoder_stats.hpp - running latency and size statistics for an encoder.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Follows each frame from when it's queued to the encoder, through the encoder giving back
+// the input buffer, to the encoded output appearing. Frames are matched by their buffer
+// memory on input and by their timestamp on output. Everything is in fixed tables so that
+// nothing is allocated per frame. Calls may come from different threads.
+
+class EncoderStats
+{
+public:
+	struct Summary
+	{
+		uint64_t frames; // encoded frames output
+		uint64_t keyframes;
+		uint64_t dropped; // frames given to the encoder that it will never output
+		double input_latency_ms; // average from queued to input buffer done
+		double max_input_latency_ms;
+		double output_latency_ms; // average from queued to output ready
+		double max_output_latency_ms;
+		double frame_bytes; // average over all frames
+		double keyframe_bytes; // average over keyframes
+		size_t max_keyframe_bytes;
+		double bitrate; // over the last second or so
+		double average_bitrate; // over the whole run
+	};
+
+	EncoderStats();
+	void Queued(void *mem, int64_t timestamp_us);
+	void InputDone(void *mem);
+	void OutputReady(int64_t timestamp_us, size_t bytes, bool keyframe);
+	void Dropped();
+	Summary Get() const;
+	// Write a summary to stderr.
+	void Print(std::string const &name) const;
+
+private:
+	using Clock = std::chrono::steady_clock;
+	static constexpr unsigned int MAX_IN_FLIGHT = 32;
+	static constexpr unsigned int MAX_RECENT = 128;
+
+	struct InFlight
+	{
+		void *mem;
+		int64_t timestamp_us;
+		Clock::time_point queued;
+		bool input_done;
+		bool output_done;
+	};
+	struct Recent
+	{
+		int64_t timestamp_us;
+		size_t bytes;
+	};
+
+	mutable std::mutex mutex_;
+	InFlight in_flight_[MAX_IN_FLIGHT];
+	unsigned int next_in_flight_;
+	Recent recent_[MAX_RECENT];
+	unsigned int next_recent_;
+	uint64_t inputs_;
+	std::chrono::duration<double> input_latency_;
+	std::chrono::duration<double> max_input_latency_;
+	uint64_t frames_;
+	uint64_t keyframes_;
+	uint64_t dropped_;
+	uint64_t outputs_; // outputs matched to when their frame was queued
+	std::chrono::duration<double> output_latency_;
+	std::chrono::duration<double> max_output_latency_;
+	uint64_t bytes_;
+	uint64_t keyframe_bytes_;
+	size_t max_keyframe_bytes_;
+	int64_t first_timestamp_us_;
+	size_t first_bytes_;
+	int64_t last_timestamp_us_;
+};
@@ -0,0 +1,238 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * libav_encoder.cpp - software video encoder using libavcodec.
+ */
+
+#include <chrono>
+#include <iostream>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+}
+
+#include "libav_encoder.hpp"
+
+static void set_colour_space(AVCodecContext *codec_ctx, std::optional<libcamera::ColorSpace> const &cs)
+{
+	codec_ctx->color_range = AVCOL_RANGE_MPEG;
+	if (cs == libcamera::ColorSpace::Rec709)
+	{
+		codec_ctx->colorspace = AVCOL_SPC_BT709;
+		codec_ctx->color_primaries = AVCOL_PRI_BT709;
+		codec_ctx->color_trc = AVCOL_TRC_BT709;
+	}
+	else if (cs == libcamera::ColorSpace::Smpte170m)
+	{
+		codec_ctx->colorspace = AVCOL_SPC_SMPTE170M;
+		codec_ctx->color_primaries = AVCOL_PRI_SMPTE170M;
+		codec_ctx->color_trc = AVCOL_TRC_SMPTE170M;
+	}
+	else if (cs == libcamera::ColorSpace::Jpeg)
+	{
+		codec_ctx->colorspace = AVCOL_SPC_SMPTE170M;
+		codec_ctx->color_primaries = AVCOL_PRI_SMPTE170M;
+		codec_ctx->color_trc = AVCOL_TRC_SMPTE170M;
+		codec_ctx->color_range = AVCOL_RANGE_JPEG;
+	}
+	else
+		std::cerr << "LibAvEncoder: surprising colour space: " << libcamera::ColorSpace::toString(cs) << std::endl;
+}
+
+LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
+	: Encoder(options), info_(info), abort_encode_(false), keyframe_requested_(false), bitrate_(options->bitrate),
+	  abort_output_(false), frames_(0), encode_time_(0)
+{
+	AVCodec const *codec = avcodec_find_encoder_by_name(options->libav_video_codec.c_str());
+	if (!codec)
+		throw std::runtime_error("libav: no encoder " + options->libav_video_codec);
+	codec_ctx_ = avcodec_alloc_context3(codec);
+	if (!codec_ctx_)
+		throw std::runtime_error("libav: failed to allocate codec context");
+
+	codec_ctx_->width = info.width;
+	codec_ctx_->height = info.height;
+	codec_ctx_->pix_fmt = AV_PIX_FMT_YUV420P;
+	// Timestamps are in microseconds throughout.
+	codec_ctx_->time_base = { 1, 1000000 };
+	codec_ctx_->framerate = { (int)(options->framerate * 1000), 1000 };
+	codec_ctx_->gop_size = options->intra ? options->intra : (int)options->framerate;
+	codec_ctx_->max_b_frames = 0; // B frames would make timestamps go out of order
+	if (options->bitrate)
+		codec_ctx_->bit_rate = options->bitrate;
+	set_colour_space(codec_ctx_, info.colour_space);
+	if (!options->level.empty())
+		codec_ctx_->level = std::stof(options->level) * 10 + 0.5;
+
+	// Let libavcodec use its own threads, as many as there are cores, splitting the frame into
+	// slices (for the lowest latency) or encoding several frames at once as the codec prefers.
+	codec_ctx_->thread_count = options->libav_threads;
+	codec_ctx_->thread_type = FF_THREAD_SLICE | FF_THREAD_FRAME;
+
+	// These are the libx264/libx265 private options. Other codecs may not have them all.
+	if (!options->libav_preset.empty())
+		av_opt_set(codec_ctx_->priv_data, "preset", options->libav_preset.c_str(), 0);
+	if (!options->libav_tune.empty())
+		av_opt_set(codec_ctx_->priv_data, "tune", options->libav_tune.c_str(), 0);
+	if (!options->profile.empty())
+		av_opt_set(codec_ctx_->priv_data, "profile", options->profile.c_str(), 0);
+	av_opt_set_int(codec_ctx_->priv_data, "forced-idr", 1, 0);
+
+	// We don't ask for global headers, so the parameter sets come with every keyframe (as
+	// though --inline were always given).
+	int ret = avcodec_open2(codec_ctx_, codec, nullptr);
+	if (ret < 0)
+	{
+		avcodec_free_context(&codec_ctx_);
+		throw std::runtime_error("libav: failed to open " + options->libav_video_codec + ": " + std::to_string(ret));
+	}
+
+	encode_thread_ = std::thread(&LibAvEncoder::encodeThread, this);
+	output_thread_ = std::thread(&LibAvEncoder::outputThread, this);
+	if (options->verbose)
+		std::cerr << "Opened LibAvEncoder using " << codec->name << std::endl;
+}
+
+LibAvEncoder::~LibAvEncoder()
+{
+	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		abort_encode_ = true;
+		encode_cond_var_.notify_one();
+	}
+	encode_thread_.join();
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abort_output_ = true;
+		output_cond_var_.notify_one();
+	}
+	output_thread_.join();
+	avcodec_free_context(&codec_ctx_);
+	if (frames_ && options_->verbose)
+		std::cerr << "Encode " << frames_ << " frames, average time " << encode_time_.count() * 1000 / frames_ << "ms"
+				  << std::endl;
+	if (options_->verbose)
+		std::cerr << "LibAvEncoder closed" << std::endl;
+}
+
+void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+{
+	AVFrame *frame = av_frame_alloc();
+	if (!frame)
+		throw std::runtime_error("libav: failed to allocate frame");
+	frame->format = AV_PIX_FMT_YUV420P;
+	frame->width = info.width;
+	frame->height = info.height;
+	frame->pts = timestamp_us;
+	frame->linesize[0] = info.stride;
+	frame->linesize[1] = frame->linesize[2] = info.stride / 2;
+	frame->data[0] = (uint8_t *)mem;
+	frame->data[1] = frame->data[0] + info.stride * info.height;
+	frame->data[2] = frame->data[1] + info.stride / 2 * info.height / 2;
+	// Wrapping the camera buffer in a reference means the codec uses it without copying, and
+	// tells us when it's done with it (which needn't be in order).
+	frame->buf[0] = av_buffer_create((uint8_t *)mem, size,
+									 [](void *opaque, uint8_t *data) {
+										 static_cast<LibAvEncoder *>(opaque)->input_done_callback_(data);
+									 },
+									 this, 0);
+	if (!frame->buf[0])
+	{
+		av_frame_free(&frame);
+		throw std::runtime_error("libav: failed to wrap buffer");
+	}
+
+	std::lock_guard<std::mutex> lock(encode_mutex_);
+	encode_queue_.push(frame);
+	encode_cond_var_.notify_one();
+}
+
+void LibAvEncoder::SetBitrate(uint32_t bitrate)
+{
+	// The x264 wrapper can only change the bitrate when it started with one.
+	if (!options_->bitrate)
+		throw std::runtime_error("libav: can only change the bitrate when started with one");
+	std::lock_guard<std::mutex> lock(encode_mutex_);
+	bitrate_ = bitrate;
+}
+
+void LibAvEncoder::RequestKeyframe()
+{
+	std::lock_guard<std::mutex> lock(encode_mutex_);
+	keyframe_requested_ = true;
+}
+
+void LibAvEncoder::receivePackets()
+{
+	while (true)
+	{
+		AVPacket *packet = av_packet_alloc();
+		if (!packet)
+			throw std::runtime_error("libav: failed to allocate packet");
+		int ret = avcodec_receive_packet(codec_ctx_, packet);
+		if (ret < 0)
+		{
+			av_packet_free(&packet);
+			if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+				return;
+			throw std::runtime_error("libav: failed to receive packet: " + std::to_string(ret));
+		}
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		output_queue_.push(packet);
+		output_cond_var_.notify_one();
+	}
+}
+
+void LibAvEncoder::encodeThread()
+{
+	while (true)
+	{
+		AVFrame *frame = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(encode_mutex_);
+			encode_cond_var_.wait(lock, [this] { return abort_encode_ || !encode_queue_.empty(); });
+			if (encode_queue_.empty())
+				break;
+			frame = encode_queue_.pop_front();
+			if (keyframe_requested_)
+				frame->pict_type = AV_PICTURE_TYPE_I;
+			keyframe_requested_ = false;
+			// The wrapper notices the change and reconfigures itself.
+			codec_ctx_->bit_rate = bitrate_;
+		}
+
+		auto start_time = std::chrono::high_resolution_clock::now();
+		int ret = avcodec_send_frame(codec_ctx_, frame);
+		av_frame_free(&frame); // the codec has its own reference if it still needs the buffer
+		if (ret < 0)
+			throw std::runtime_error("libav: failed to send frame: " + std::to_string(ret));
+		receivePackets();
+		encode_time_ += std::chrono::high_resolution_clock::now() - start_time;
+		frames_++;
+	}
+
+	// Flush out the last few frames.
+	avcodec_send_frame(codec_ctx_, nullptr);
+	receivePackets();
+}
+
+void LibAvEncoder::outputThread()
+{
+	while (true)
+	{
+		AVPacket *packet;
+		{
+			std::unique_lock<std::mutex> lock(output_mutex_);
+			output_cond_var_.wait(lock, [this] { return abort_output_ || !output_queue_.empty(); });
+			// Finish anything still queued before we quit.
+			if (output_queue_.empty())
+				return;
+			packet = output_queue_.pop_front();
+		}
+		output_ready_callback_(packet->data, packet->size, packet->pts, !!(packet->flags & AV_PKT_FLAG_KEY));
+		av_packet_free(&packet);
+	}
+}
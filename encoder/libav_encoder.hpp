@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * libav_encoder.hpp - software video encoder using libavcodec.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "core/recycling_queue.hpp"
+
+#include "encoder.hpp"
+
+struct AVCodecContext;
+struct AVFrame;
+struct AVPacket;
+
+// Encodes with one of libavcodec's software encoders (libx264 or libx265), for when there's
+// no hardware encoder. The encoder's own threading does the hard work; we feed it from one
+// thread and pass the results on from another, like the hardware H.264 encoder.
+
+class LibAvEncoder : public Encoder
+{
+public:
+	LibAvEncoder(VideoOptions const *options, StreamInfo const &info);
+	~LibAvEncoder();
+	// Encode the given buffer. The encoder reads it directly, and we're told when it's done.
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	void SetBitrate(uint32_t bitrate) override;
+	void RequestKeyframe() override;
+
+private:
+	// Feed frames to the codec and collect the encoded packets.
+	void encodeThread();
+	// Hand the encoded packets to the application.
+	void outputThread();
+	void receivePackets();
+
+	AVCodecContext *codec_ctx_;
+	StreamInfo info_;
+
+	std::mutex encode_mutex_;
+	std::condition_variable encode_cond_var_;
+	RecyclingQueue<AVFrame *> encode_queue_;
+	bool abort_encode_;
+	bool keyframe_requested_;
+	uint32_t bitrate_;
+	std::thread encode_thread_;
+
+	std::mutex output_mutex_;
+	std::condition_variable output_cond_var_;
+	RecyclingQueue<AVPacket *> output_queue_;
+	bool abort_output_;
+	std::thread output_thread_;
+
+	unsigned int frames_;
+	std::chrono::duration<double> encode_time_;
+};
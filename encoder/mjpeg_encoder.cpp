@@ -5,36 +5,198 @@
  * mjpeg_encoder.cpp - mjpeg video encoder.
  */
 
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <algorithm>
 #include <chrono>
+#include <cstring>
+#include <future>
 #include <iostream>
 
 #include <jpeglib.h>
+#include <jerror.h>
+
+#include "core/executor.hpp"
 
 #include "mjpeg_encoder.hpp"
 
-#if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
-typedef size_t jpeg_mem_len_t;
-#else
-typedef unsigned long jpeg_mem_len_t;
-#endif
+// One libjpeg compressor, with our own destination manager that writes into a buffer that
+// we keep and re-use (rather than a new one every frame, like jpeg_mem_dest).
+struct JpegCompressor
+{
+	JpegCompressor()
+	{
+		cinfo.err = jpeg_std_error(&jerr);
+		jpeg_create_compress(&cinfo);
+		cinfo.client_data = this;
+		dest.init_destination = [](j_compress_ptr) {};
+		dest.empty_output_buffer = [](j_compress_ptr cinfo) -> boolean {
+			// The buffer is full, so double its size.
+			JpegCompressor *compressor = static_cast<JpegCompressor *>(cinfo->client_data);
+			size_t old_size = compressor->size;
+			uint8_t *mem = (uint8_t *)realloc(compressor->mem, old_size * 2);
+			if (!mem)
+				ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+			compressor->mem = mem;
+			compressor->size = old_size * 2;
+			compressor->dest.next_output_byte = mem + old_size;
+			compressor->dest.free_in_buffer = old_size;
+			return TRUE;
+		};
+		dest.term_destination = [](j_compress_ptr) {};
+		cinfo.dest = &dest;
+	}
+	~JpegCompressor() { jpeg_destroy_compress(&cinfo); }
+
+	// Compress the given rows of a YUV420 image into our buffer, returning the number of
+	// bytes written.
+	size_t Compress(StreamInfo const &info, uint8_t const *image, unsigned int y0, unsigned int rows, int quality,
+					unsigned int restart_interval);
+
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	struct jpeg_destination_mgr dest;
+	// The buffer we're writing into. Nothing frees this for us.
+	uint8_t *mem = nullptr;
+	size_t size = 0;
+	// What the compression parameters were last set up for.
+	unsigned int width = 0;
+	unsigned int height = 0;
+	int quality = -1;
+};
+
+size_t JpegCompressor::Compress(StreamInfo const &info, uint8_t const *image, unsigned int y0, unsigned int rows,
+								int quality, unsigned int restart_interval)
+{
+	// Copied from YUV420_to_JPEG_fast in jpeg.cpp. The quantisation and Huffman tables
+	// stay in the compressor, so we only need to set them up again if something changes.
+	if (width != info.width || height != rows || this->quality != quality)
+	{
+		cinfo.image_width = info.width;
+		cinfo.image_height = rows;
+		cinfo.input_components = 3;
+		cinfo.in_color_space = JCS_YCbCr;
+
+		jpeg_set_defaults(&cinfo);
+		cinfo.raw_data_in = TRUE;
+		jpeg_set_quality(&cinfo, quality, TRUE);
+		width = info.width;
+		height = rows;
+		this->quality = quality;
+	}
+	cinfo.restart_interval = restart_interval;
+
+	if (!mem)
+	{
+		size = 65536;
+		mem = (uint8_t *)malloc(size);
+		if (!mem)
+			throw std::runtime_error("failed to allocate MJPEG output buffer");
+	}
+	dest.next_output_byte = mem;
+	dest.free_in_buffer = size;
+	jpeg_start_compress(&cinfo, TRUE);
+
+	int stride2 = info.stride / 2;
+	uint8_t *Y = (uint8_t *)image;
+	uint8_t *U = (uint8_t *)Y + info.stride * info.height;
+	uint8_t *V = (uint8_t *)U + stride2 * (info.height / 2);
+	uint8_t *Y_max = U - info.stride;
+	uint8_t *U_max = V - stride2;
+	uint8_t *V_max = U_max + stride2 * (info.height / 2);
+
+	JSAMPROW y_rows[16];
+	JSAMPROW u_rows[8];
+	JSAMPROW v_rows[8];
+
+	for (uint8_t *Y_row = Y + y0 * info.stride, *U_row = U + y0 / 2 * stride2, *V_row = V + y0 / 2 * stride2;
+		 cinfo.next_scanline < rows;)
+	{
+		for (int i = 0; i < 16; i++, Y_row += info.stride)
+			y_rows[i] = std::min(Y_row, Y_max);
+		for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
+			u_rows[i] = std::min(U_row, U_max), v_rows[i] = std::min(V_row, V_max);
+
+		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
+		jpeg_write_raw_data(&cinfo, rows, 16);
+	}
+
+	jpeg_finish_compress(&cinfo);
+	return size - dest.free_in_buffer;
+}
+
+struct MjpegEncoder::EncodeContext
+{
+	// One compressor for each strip of the image, and the size of what each one made.
+	std::vector<std::unique_ptr<JpegCompressor>> strips;
+	std::vector<size_t> lens;
+	std::vector<std::future<void>> futures;
+	std::chrono::duration<double> encode_time;
+	uint32_t frames;
+};
 
 MjpegEncoder::MjpegEncoder(VideoOptions const *options)
-	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
+	: Encoder(options), abortOutput_(false), index_(0), buffer_size_(0), bitrate_(options->bitrate),
+	  quality_(options->quality), buffer_fullness_(0), last_timestamp_us_(-1), total_bytes_(0), first_timestamp_us_(-1)
 {
+	for (unsigned int i = 0; i < options->mjpeg_threads; i++)
+	{
+		contexts_.push_back(std::make_unique<EncodeContext>());
+		EncodeContext &context = *contexts_.back();
+		for (unsigned int j = 0; j < options->mjpeg_strips; j++)
+			context.strips.push_back(std::make_unique<JpegCompressor>());
+		context.lens.resize(options->mjpeg_strips);
+		context.futures.resize(options->mjpeg_strips);
+		context.encode_time = std::chrono::duration<double>(0);
+		context.frames = 0;
+		idle_contexts_.push_back(&context);
+	}
+	// Leave some room for frames to finish out of order, and for output being slow.
+	output_ring_size_ = std::max(8u, 2 * options->mjpeg_threads);
+	output_ring_ = std::make_unique<OutputSlot[]>(output_ring_size_);
+	for (unsigned int i = 0; i < output_ring_size_; i++)
+		output_ring_[i].ready = 0;
+	output_index_ = 0;
+	output_stalled_ = false;
+	output_event_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (output_event_fd_ < 0)
+		throw std::runtime_error("failed to create eventfd");
 	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i] = std::thread(std::bind(&MjpegEncoder::encodeThread, this, i));
 	if (options_->verbose)
-		std::cerr << "Opened MjpegEncoder" << std::endl;
+		std::cerr << "Opened MjpegEncoder with " << contexts_.size() << " threads and " << options->mjpeg_strips
+				  << " strips" << std::endl;
 }
 
 MjpegEncoder::~MjpegEncoder()
 {
-	abortEncode_ = true;
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i].join();
+	{
+		// Let the encode tasks finish everything that's queued.
+		std::unique_lock<std::mutex> lock(encode_mutex_);
+		encode_cond_var_.wait(lock,
+							  [this]() { return idle_contexts_.size() == contexts_.size() && encode_queue_.empty(); });
+	}
+	for (auto &context : contexts_)
+	{
+		if (context->frames && options_->verbose)
+			std::cerr << "Encode " << context->frames << " frames, average time "
+					  << context->encode_time.count() * 1000 / context->frames << "ms" << std::endl;
+		// The first strip's buffer belongs to the pool (see encodeJPEG).
+		for (unsigned int i = 1; i < context->strips.size(); i++)
+			free(context->strips[i]->mem);
+	}
 	abortOutput_ = true;
+	uint64_t one = 1;
+	if (write(output_event_fd_, &one, sizeof(one)) < 0)
+		std::cerr << "Failed to wake MJPEG output thread" << std::endl;
 	output_thread_.join();
+	close(output_event_fd_);
+	if (options_->verbose && bitrate_ && last_timestamp_us_ > first_timestamp_us_)
+		std::cerr << "MJPEG average bitrate " << total_bytes_ * 8e6 / (last_timestamp_us_ - first_timestamp_us_)
+				  << " bits/second, final quality " << (int)quality_ << std::endl;
+	for (auto &buffer : free_buffers_)
+		free(buffer.mem);
 	if (options_->verbose)
 		std::cerr << "MjpegEncoder closed" << std::endl;
 }
@@ -44,152 +206,293 @@ void MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 	std::lock_guard<std::mutex> lock(encode_mutex_);
 	EncodeItem item = { mem, info, timestamp_us, index_++ };
 	encode_queue_.push(item);
-	encode_cond_var_.notify_all();
-}
-
-void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
-							  size_t &buffer_len)
-{
-	// Copied from YUV420_to_JPEG_fast in jpeg.cpp.
-	cinfo.image_width = item.info.width;
-	cinfo.image_height = item.info.height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = 0;
-
-	jpeg_set_defaults(&cinfo);
-	cinfo.raw_data_in = TRUE;
-	jpeg_set_quality(&cinfo, options_->quality, TRUE);
-	encoded_buffer = nullptr;
-	buffer_len = 0;
-	jpeg_mem_len_t jpeg_mem_len;
-	jpeg_mem_dest(&cinfo, &encoded_buffer, &jpeg_mem_len);
-	jpeg_start_compress(&cinfo, TRUE);
+	// Start another encode task if there's a context free. Otherwise one of the running
+	// tasks will pick this frame up when it's done.
+	if (!idle_contexts_.empty())
+	{
+		EncodeContext *context = idle_contexts_.back();
+		idle_contexts_.pop_back();
+		Executor::Get().Post(Executor::ENCODE, [this, context]() { encodeTask(*context); });
+	}
+}
 
-	int stride2 = item.info.stride / 2;
-	uint8_t *Y = (uint8_t *)item.mem;
-	uint8_t *U = (uint8_t *)Y + item.info.stride * item.info.height;
-	uint8_t *V = (uint8_t *)U + stride2 * (item.info.height / 2);
-	uint8_t *Y_max = U - item.info.stride;
-	uint8_t *U_max = V - stride2;
-	uint8_t *V_max = U_max + stride2 * (item.info.height / 2);
+MjpegEncoder::JpegBuffer MjpegEncoder::getBuffer()
+{
+	std::lock_guard<std::mutex> lock(buffers_mutex_);
+	if (free_buffers_.empty())
+	{
+		// Start new buffers as big as any we've needed so far.
+		size_t size = std::max(buffer_size_, (size_t)65536);
+		JpegBuffer buffer = { (uint8_t *)malloc(size), size };
+		if (!buffer.mem)
+			throw std::runtime_error("failed to allocate MJPEG output buffer");
+		return buffer;
+	}
+	JpegBuffer buffer = free_buffers_.back();
+	free_buffers_.pop_back();
+	return buffer;
+}
 
-	JSAMPROW y_rows[16];
-	JSAMPROW u_rows[8];
-	JSAMPROW v_rows[8];
+void MjpegEncoder::returnBuffer(JpegBuffer const &buffer)
+{
+	std::lock_guard<std::mutex> lock(buffers_mutex_);
+	buffer_size_ = std::max(buffer_size_, buffer.size);
+	free_buffers_.push_back(buffer);
+}
 
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < item.info.height;)
+// Find where the entropy-coded data starts in a JPEG, just after the SOS marker segment.
+static size_t scan_start(uint8_t const *jpeg, size_t len)
+{
+	size_t pos = 2; // skip SOI
+	while (pos + 4 <= len && jpeg[pos] == 0xff)
 	{
-		for (int i = 0; i < 16; i++, Y_row += item.info.stride)
-			y_rows[i] = std::min(Y_row, Y_max);
-		for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
-			u_rows[i] = std::min(U_row, U_max), v_rows[i] = std::min(V_row, V_max);
+		uint8_t marker = jpeg[pos + 1];
+		pos += 2 + (jpeg[pos + 2] << 8 | jpeg[pos + 3]);
+		if (marker == 0xda)
+			return pos;
+	}
+	throw std::runtime_error("MJPEG strip has no scan");
+}
 
-		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
-		jpeg_write_raw_data(&cinfo, rows, 16);
+size_t MjpegEncoder::encodeJPEG(EncodeContext &context, EncodeItem &item, JpegBuffer &buffer)
+{
+	StreamInfo const &info = item.info;
+	uint8_t const *image = (uint8_t const *)item.mem;
+	int quality = frameQuality();
+
+	// The first strip writes straight into the output buffer. With only one, that's all.
+	JpegCompressor &first = *context.strips[0];
+	first.mem = buffer.mem, first.size = buffer.size;
+	if (context.strips.size() == 1)
+	{
+		size_t len = first.Compress(info, image, 0, info.height, quality, 0);
+		buffer = { first.mem, first.size };
+		return len;
 	}
 
-	jpeg_finish_compress(&cinfo);
-	buffer_len = jpeg_mem_len;
+	// Otherwise each strip is a whole number of MCU rows (16 pixels), and ends a restart
+	// interval, so the strips' scans can be joined with RSTn markers into one valid JPEG.
+	// The strips are encoded as separate images at the same time, the first one here.
+	unsigned int mcu_rows = (info.height + 15) / 16;
+	unsigned int strip_mcu_rows = (mcu_rows + context.strips.size() - 1) / context.strips.size();
+	unsigned int num_strips = (mcu_rows + strip_mcu_rows - 1) / strip_mcu_rows;
+	unsigned int strip_height = strip_mcu_rows * 16;
+	unsigned int restart_interval = strip_mcu_rows * ((info.width + 15) / 16);
+	if (restart_interval > 65535)
+		throw std::runtime_error("MJPEG strips too big for restart markers - use more strips");
+
+	std::vector<size_t> &lens = context.lens;
+	std::vector<std::future<void>> &futures = context.futures;
+	for (unsigned int i = 1; i < num_strips; i++)
+	{
+		unsigned int y0 = i * strip_height, rows = std::min(strip_height, info.height - y0);
+		futures[i] = Executor::Get().Submit(Executor::ENCODE, [&, i, y0, rows]() {
+			lens[i] = context.strips[i]->Compress(info, image, y0, rows, quality, restart_interval);
+		});
+	}
+	lens[0] = first.Compress(info, image, 0, strip_height, quality, restart_interval);
+	for (unsigned int i = 1; i < num_strips; i++)
+		Executor::Get().Wait(futures[i]);
+
+	// The first strip supplies the headers (including the DRI marker), once its SOF is
+	// given the full image height.
+	uint8_t *out = first.mem;
+	size_t pos = scan_start(out, lens[0]);
+	for (size_t sof = 2; sof < pos; sof += 2 + (out[sof + 2] << 8 | out[sof + 3]))
+	{
+		if (out[sof + 1] == 0xc0)
+		{
+			out[sof + 5] = info.height >> 8;
+			out[sof + 6] = info.height & 0xff;
+		}
+	}
+	pos = lens[0] - 2; // drop its EOI
+
+	size_t total = pos + 2;
+	for (unsigned int i = 1; i < num_strips; i++)
+		total += 2 + lens[i] - 2 - scan_start(context.strips[i]->mem, lens[i]);
+	if (total > first.size)
+	{
+		out = (uint8_t *)realloc(first.mem, total);
+		if (!out)
+			throw std::runtime_error("failed to grow MJPEG output buffer");
+		first.mem = out, first.size = total;
+	}
+
+	for (unsigned int i = 1; i < num_strips; i++)
+	{
+		JpegCompressor &strip = *context.strips[i];
+		size_t start = scan_start(strip.mem, lens[i]);
+		out[pos++] = 0xff;
+		out[pos++] = 0xd0 + (i - 1) % 8;
+		memcpy(out + pos, strip.mem + start, lens[i] - 2 - start);
+		pos += lens[i] - 2 - start;
+	}
+	out[pos++] = 0xff;
+	out[pos++] = 0xd9; // EOI
+
+	buffer = { first.mem, first.size };
+	return pos;
 }
 
-void MjpegEncoder::encodeThread(int num)
+void MjpegEncoder::encodeTask(EncodeContext &context)
 {
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-	std::chrono::duration<double> encode_time(0);
-	uint32_t frames = 0;
-
 	EncodeItem encode_item;
-	while (true)
 	{
+		std::lock_guard<std::mutex> lock(encode_mutex_);
+		// Another task may have taken the frame we were started for, or there may be
+		// nowhere to put it until the output thread catches up.
+		if (encode_queue_.empty() || !slotFree(encode_queue_.front().index))
 		{
-			std::unique_lock<std::mutex> lock(encode_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				if (abortEncode_ && encode_queue_.empty())
-				{
-					if (frames && options_->verbose)
-						std::cerr << "Encode " << frames << " frames, average time "
-								  << encode_time.count() * 1000 / frames << "ms" << std::endl;
-					jpeg_destroy_compress(&cinfo);
-					return;
-				}
-				if (!encode_queue_.empty())
-				{
-					encode_item = encode_queue_.front();
-					encode_queue_.pop();
-					break;
-				}
-				else
-					encode_cond_var_.wait_for(lock, 200ms);
-			}
+			idle_contexts_.push_back(&context);
+			encode_cond_var_.notify_all();
+			return;
 		}
+		encode_item = encode_queue_.pop_front();
+	}
+
+	// Encode the buffer.
+	JpegBuffer buffer = getBuffer();
+	auto start_time = std::chrono::high_resolution_clock::now();
+	size_t buffer_len = encodeJPEG(context, encode_item, buffer);
+	context.encode_time += (std::chrono::high_resolution_clock::now() - start_time);
+	context.frames++;
+	// The camera can have this buffer back now, even if earlier frames are still encoding.
+	input_done_callback_(encode_item.mem);
+
+	// We push this encoded buffer to another thread so that our
+	// application can take its time with the data without blocking the
+	// encode process.
+	OutputSlot &slot = output_ring_[encode_item.index % output_ring_size_];
+	slot.item = { buffer, buffer_len, encode_item.timestamp_us };
+	slot.ready.store(encode_item.index + 1, std::memory_order_release);
+	uint64_t one = 1;
+	if (write(output_event_fd_, &one, sizeof(one)) < 0)
+		std::cerr << "Failed to wake MJPEG output thread" << std::endl;
+
+	// Carry on with the next frame as a new task, so that more urgent work can run in between.
+	std::lock_guard<std::mutex> lock(encode_mutex_);
+	if (encode_queue_.empty() || !slotFree(encode_queue_.front().index))
+	{
+		idle_contexts_.push_back(&context);
+		encode_cond_var_.notify_all();
+	}
+	else
+		Executor::Get().Post(Executor::ENCODE, [this, &context]() { encodeTask(context); });
+}
+
+void MjpegEncoder::SetBitrate(uint32_t bitrate)
+{
+	std::lock_guard<std::mutex> lock(rate_mutex_);
+	if (bitrate && !bitrate_)
+		buffer_fullness_ = 0;
+	bitrate_ = bitrate;
+}
+
+int MjpegEncoder::frameQuality()
+{
+	std::lock_guard<std::mutex> lock(rate_mutex_);
+	return bitrate_ ? (int)(quality_ + 0.5) : options_->quality;
+}
+
+// How libjpeg turns quality into a scale factor (a percentage) for the quantisation tables.
+static double quality_to_scale(double quality)
+{
+	return quality < 50 ? 5000 / quality : 200 - 2 * quality;
+}
+
+static double scale_to_quality(double scale)
+{
+	return scale > 100 ? 5000 / scale : (200 - scale) / 2;
+}
+
+void MjpegEncoder::updateRateControl(size_t bytes, int64_t timestamp_us)
+{
+	// How long to smooth out the bitrate over.
+	constexpr double BUFFER_SECONDS = 0.5;
+	// Don't change the quality by too much at once, as the frames already being encoded
+	// mean we see the effect late.
+	constexpr double MAX_SCALE_CHANGE = 1.25;
+	constexpr double MIN_QUALITY = 5, MAX_QUALITY = 95;
 
-		// Encode the buffer.
-		uint8_t *encoded_buffer = nullptr;
-		size_t buffer_len = 0;
-		auto start_time = std::chrono::high_resolution_clock::now();
-		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_len);
-		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
-		frames++;
-		// Don't return buffers until the output thread as that's where they're
-		// in order again.
+	std::lock_guard<std::mutex> lock(rate_mutex_);
+	if (first_timestamp_us_ < 0)
+		first_timestamp_us_ = timestamp_us;
+	total_bytes_ += bytes;
+	double frame_time = last_timestamp_us_ < 0 ? 1.0 / 30 : (timestamp_us - last_timestamp_us_) / 1e6;
+	last_timestamp_us_ = timestamp_us;
+	if (!bitrate_ || frame_time <= 0)
+		return;
 
-		// We push this encoded buffer to another thread so that our
-		// application can take its time with the data without blocking the
-		// encode process.
-		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
-		std::lock_guard<std::mutex> lock(output_mutex_);
-		output_queue_[num].push(output_item);
-		output_cond_var_.notify_one();
+	double bits = bytes * 8.0;
+	double buffer_size = bitrate_ * BUFFER_SECONDS;
+	buffer_fullness_ = std::max(0.0, buffer_fullness_ + bits - bitrate_ * frame_time);
+
+	// Aim the next frame at the bitrate, plus or minus whatever brings the buffer back
+	// towards half full over the buffer's length.
+	double target = bitrate_ * frame_time * (1 + (buffer_size / 2 - buffer_fullness_) / buffer_size);
+	target = std::max(target, bitrate_ * frame_time / 4);
+
+	// Frame sizes go roughly inversely with the quantisation scale.
+	double change = std::clamp(bits / target, 1 / MAX_SCALE_CHANGE, MAX_SCALE_CHANGE);
+	double scale = quality_to_scale(quality_) * change;
+	quality_ = std::clamp(scale_to_quality(scale), MIN_QUALITY, MAX_QUALITY);
+}
+
+// Call with encode_mutex_ held.
+bool MjpegEncoder::slotFree(uint64_t index)
+{
+	if (index < output_index_ + output_ring_size_)
+		return true;
+	// Check again once the stall is flagged, in case the output thread moved on in between
+	// and so won't have seen it.
+	output_stalled_ = true;
+	if (index < output_index_ + output_ring_size_)
+	{
+		output_stalled_ = false;
+		return true;
+	}
+	return false;
+}
+
+void MjpegEncoder::restartEncoding()
+{
+	std::lock_guard<std::mutex> lock(encode_mutex_);
+	if (!encode_queue_.empty() && !idle_contexts_.empty())
+	{
+		EncodeContext *context = idle_contexts_.back();
+		idle_contexts_.pop_back();
+		Executor::Get().Post(Executor::ENCODE, [this, context]() { encodeTask(*context); });
 	}
 }
 
 void MjpegEncoder::outputThread()
 {
-	OutputItem item;
-	uint64_t index = 0;
-	while (true)
+	for (uint64_t index = 0;;)
 	{
+		OutputSlot &slot = output_ring_[index % output_ring_size_];
+		if (slot.ready.load(std::memory_order_acquire) == index + 1)
 		{
-			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				// We look for the thread that's completed the frame we want next.
-				// If we don't find it, we wait.
-				//
-				// Must also check for an abort signal, and if set, all queues must
-				// be empty. This is done first to ensure all frame callbacks have
-				// had a chance to run.
-				bool abort = abortOutput_ ? true : false;
-				for (auto &q : output_queue_)
-				{
-					if (abort && !q.empty())
-						abort = false;
-
-					if (!q.empty() && q.front().index == index)
-					{
-						item = q.front();
-						q.pop();
-						goto got_item;
-					}
-				}
-				if (abort)
-					return;
-
-				output_cond_var_.wait_for(lock, 200ms);
-			}
+			OutputItem &item = slot.item;
+			output_ready_callback_(item.buffer.mem, item.bytes_used, item.timestamp_us, true);
+			updateRateControl(item.bytes_used, item.timestamp_us);
+			returnBuffer(item.buffer);
+			output_index_ = ++index;
+			if (output_stalled_.exchange(false))
+				restartEncoding();
+			continue;
 		}
-	got_item:
-		input_done_callback_(nullptr);
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
-		free(item.mem);
-		index++;
+		// Everything has been encoded before we're told to quit, so there's nothing more to come.
+		if (abortOutput_)
+			return;
+
+		// Wait until another frame is ready or we're told to quit.
+		uint64_t count;
+		if (read(output_event_fd_, &count, sizeof(count)) < 0 && errno != EINTR)
+		{
+			std::cerr << "MJPEG output thread failed to wait" << std::endl;
+			return;
+		}
 	}
 }
@@ -7,14 +7,16 @@
 
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <vector>
 
-#include "encoder.hpp"
+#include "core/recycling_queue.hpp"
 
-struct jpeg_compress_struct;
+#include "encoder.hpp"
 
 class MjpegEncoder : public Encoder
 {
@@ -23,21 +25,24 @@ public:
 	~MjpegEncoder();
 	// Encode the given buffer.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	// Aim for this bitrate by varying the quality, or use the fixed quality if zero.
+	void SetBitrate(uint32_t bitrate) override;
 
 private:
-	// How many threads to use. Whichever thread is idle will pick up the next frame.
-	static const int NUM_ENC_THREADS = 4;
+	// Each frame being encoded has its own libjpeg context, and the encoding is done by
+	// tasks on the shared Executor rather than threads of our own. The number of contexts
+	// (--mjpeg-threads) is how many frames can be encoded at once.
+	struct EncodeContext;
 
-	// These threads do the actual encoding.
-	void encodeThread(int num);
+	// Encode the next frame from the queue using the given context.
+	void encodeTask(EncodeContext &context);
 
 	// Handle the output buffers in another thread so as not to block the encoders. The
 	// application can take its time, after which we return this buffer to the encoder for
 	// re-use.
 	void outputThread();
 
-	bool abortEncode_;
-	bool abortOutput_;
+	std::atomic<bool> abortOutput_;
 	uint64_t index_;
 
 	struct EncodeItem
@@ -47,21 +52,68 @@ private:
 		int64_t timestamp_us;
 		uint64_t index;
 	};
-	std::queue<EncodeItem> encode_queue_;
+	RecyclingQueue<EncodeItem> encode_queue_;
 	std::mutex encode_mutex_;
 	std::condition_variable encode_cond_var_;
-	std::thread encode_thread_[NUM_ENC_THREADS];
-	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
+	std::vector<std::unique_ptr<EncodeContext>> contexts_;
+	// Contexts with no encode task running.
+	std::vector<EncodeContext *> idle_contexts_;
+
+	// Encoded frames are written into these, which are re-used once output. A buffer that
+	// turns out to be too small grows, so they soon all fit whatever frames we're making.
+	struct JpegBuffer
+	{
+		uint8_t *mem;
+		size_t size;
+	};
+	std::vector<JpegBuffer> free_buffers_;
+	size_t buffer_size_;
+	std::mutex buffers_mutex_;
+	JpegBuffer getBuffer();
+	void returnBuffer(JpegBuffer const &buffer);
+
+	// Encode a frame into the given buffer (which may be swapped for a bigger one), returning
+	// the number of bytes written.
+	size_t encodeJPEG(EncodeContext &context, EncodeItem &item, JpegBuffer &buffer);
 
+	// Encoded frames go into a ring of slots indexed by frame number, so the output thread
+	// just waits for the next slot to fill to get them back in order. A slot's "ready" value
+	// is the frame number plus one once its item has been written.
 	struct OutputItem
 	{
-		void *mem;
+		JpegBuffer buffer;
 		size_t bytes_used;
 		int64_t timestamp_us;
-		uint64_t index;
 	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
-	std::mutex output_mutex_;
-	std::condition_variable output_cond_var_;
+	struct OutputSlot
+	{
+		std::atomic<uint64_t> ready;
+		OutputItem item;
+	};
+	std::unique_ptr<OutputSlot[]> output_ring_;
+	unsigned int output_ring_size_;
+	// The next frame for the output thread, so a frame's slot is free once this is
+	// within output_ring_size_ of it.
+	std::atomic<uint64_t> output_index_;
+	// Set when a frame can't start encoding because its slot is in use, so that the output
+	// thread knows to restart the encoding when it has freed some slots.
+	std::atomic<bool> output_stalled_;
+	// Written to wake the output thread when a frame is ready or we want it to quit.
+	int output_event_fd_;
+	bool slotFree(uint64_t index);
+	void restartEncoding();
 	std::thread output_thread_;
+
+	// Rate control. We model a buffer draining at the target bitrate (like an H.264 "VBV")
+	// and adjust the quality of each new frame to keep it about half full. As several
+	// frames are encoded at once, each new frame only sees the sizes of ones already output.
+	int frameQuality();
+	void updateRateControl(size_t bytes, int64_t timestamp_us);
+	std::mutex rate_mutex_;
+	uint32_t bitrate_;
+	double quality_;
+	double buffer_fullness_;
+	int64_t last_timestamp_us_;
+	uint64_t total_bytes_;
+	int64_t first_timestamp_us_;
 };
@@ -5,12 +5,54 @@
  * null_encoder.cpp - dummy "do nothing" video encoder.
  */
 
-#include <chrono>
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <libcamera/formats.h>
+
 #include "null_encoder.hpp"
 
+// Interleave n bytes each of u and v into dst, as for the chroma plane of NV12.
+static void interleave_row(uint8_t *dst, uint8_t const *u, uint8_t const *v, unsigned int n)
+{
+	unsigned int x = 0;
+#if defined(__ARM_NEON)
+	for (; x + 16 <= n; x += 16)
+	{
+		uint8x16x2_t uv = { { vld1q_u8(u + x), vld1q_u8(v + x) } };
+		vst2q_u8(dst + 2 * x, uv);
+	}
+#elif defined(__SSE2__)
+	for (; x + 16 <= n; x += 16)
+	{
+		__m128i u16 = _mm_loadu_si128((__m128i const *)(u + x));
+		__m128i v16 = _mm_loadu_si128((__m128i const *)(v + x));
+		_mm_storeu_si128((__m128i *)(dst + 2 * x), _mm_unpacklo_epi8(u16, v16));
+		_mm_storeu_si128((__m128i *)(dst + 2 * x + 16), _mm_unpackhi_epi8(u16, v16));
+	}
+#endif
+	for (; x < n; x++)
+	{
+		dst[2 * x] = u[x];
+		dst[2 * x + 1] = v[x];
+	}
+}
+
+static uint8_t *copy_rows(uint8_t *dst, uint8_t const *src, unsigned int width, unsigned int stride,
+						  unsigned int height)
+{
+	for (unsigned int y = 0; y < height; y++, dst += width, src += stride)
+		memcpy(dst, src, width);
+	return dst;
+}
+
 NullEncoder::NullEncoder(VideoOptions const *options) : Encoder(options), abort_(false)
 {
 	if (options->verbose)
@@ -20,9 +62,13 @@ NullEncoder::NullEncoder(VideoOptions const *options) : Encoder(options), abort_
 
 NullEncoder::~NullEncoder()
 {
-	abort_ = true;
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abort_ = true;
+		output_cond_var_.notify_one();
+	}
 	output_thread_.join();
-	if (options_.verbose)
+	if (options_->verbose)
 		std::cerr << "NullEncoder closed" << std::endl;
 }
 
@@ -30,7 +76,7 @@ NullEncoder::~NullEncoder()
 void NullEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
 	std::lock_guard<std::mutex> lock(output_mutex_);
-	OutputItem item = { mem, size, timestamp_us };
+	OutputItem item = { mem, size, timestamp_us, info };
 	output_queue_.push(item);
 	output_cond_var_.notify_one();
 }
@@ -44,22 +90,60 @@ void NullEncoder::outputThread()
 	{
 		{
 			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				if (!output_queue_.empty())
-				{
-					item = output_queue_.front();
-					output_queue_.pop();
-					break;
-				}
-				else
-					output_cond_var_.wait_for(lock, 200ms);
-				if (abort_)
-					return;
-			}
+			output_cond_var_.wait(lock, [this] { return abort_ || !output_queue_.empty(); });
+			// Finish anything still queued before we quit.
+			if (output_queue_.empty())
+				return;
+			item = output_queue_.pop_front();
+		}
+		// Packing the image means we can give the camera its buffer back before the output
+		// has the copy.
+		size_t packed_size = pack(item);
+		if (packed_size)
+		{
+			input_done_callback_(item.mem);
+			output_ready_callback_(packed_.data(), packed_size, item.timestamp_us, true);
+		}
+		else
+		{
+			output_ready_callback_(item.mem, item.length, item.timestamp_us, true);
+			input_done_callback_(item.mem);
 		}
-		output_ready_callback_(item.mem, item.length, item.timestamp_us, true);
-		input_done_callback_(nullptr);
 	}
 }
+
+// The camera's YUV420 images have each plane's rows padded out to the stride. Consumers
+// often want plain I420 or NV12 instead, which we can make with one pass over the image
+// (the memcpys and the interleaving are vectorised). Returns 0 for images we should send
+// unchanged, including I420 that has no padding in the first place.
+size_t NullEncoder::pack(OutputItem const &item)
+{
+	StreamInfo const &info = item.info;
+	if (options_->yuv_pack == "none" || info.pixel_format != libcamera::formats::YUV420 ||
+		(options_->yuv_pack == "i420" && info.stride == info.width))
+		return 0;
+
+	// Odd sizes still have a chroma sample covering the last column and row.
+	unsigned int chroma_width = (info.width + 1) / 2, chroma_height = (info.height + 1) / 2;
+	unsigned int chroma_stride = info.stride / 2;
+	size_t packed_size = info.width * info.height + 2 * chroma_width * chroma_height;
+	if (packed_.size() < packed_size)
+		packed_.resize(packed_size);
+
+	uint8_t const *y = (uint8_t const *)item.mem;
+	uint8_t const *u = y + info.stride * info.height;
+	uint8_t const *v = u + chroma_stride * chroma_height;
+	uint8_t *dst = copy_rows(packed_.data(), y, info.width, info.stride, info.height);
+	if (options_->yuv_pack == "i420")
+	{
+		dst = copy_rows(dst, u, chroma_width, chroma_stride, chroma_height);
+		copy_rows(dst, v, chroma_width, chroma_stride, chroma_height);
+	}
+	else
+	{
+		for (unsigned int row = 0; row < chroma_height; row++, dst += 2 * chroma_width)
+			interleave_row(dst, u + row * chroma_stride, v + row * chroma_stride, chroma_width);
+	}
+
+	return packed_size;
+}
@@ -9,9 +9,10 @@
 
 #include <condition_variable>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <vector>
 
+#include "core/recycling_queue.hpp"
 #include "core/video_options.hpp"
 #include "encoder.hpp"
 
@@ -26,15 +27,19 @@ private:
 	void outputThread();
 
 	bool abort_;
-	VideoOptions options_;
 	struct OutputItem
 	{
 		void *mem;
 		size_t length;
 		int64_t timestamp_us;
+		StreamInfo info;
 	};
-	std::queue<OutputItem> output_queue_;
+	// Copy the image into packed_ without any stride padding, returning its size.
+	size_t pack(OutputItem const &item);
+	RecyclingQueue<OutputItem> output_queue_;
 	std::mutex output_mutex_;
 	std::condition_variable output_cond_var_;
 	std::thread output_thread_;
+	// Only the output thread uses this, so once it's big enough it's simply re-used.
+	std::vector<uint8_t> packed_;
 };
@@ -0,0 +1,610 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * v4l2_encoder.cpp - V4L2 memory-to-memory video encoder.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "core/memory_report.hpp"
+
+#include "v4l2_encoder.hpp"
+
+static int xioctl(int fd, unsigned long ctl, void *arg)
+{
+	int ret, num_tries = 10;
+	do
+	{
+		ret = ioctl(fd, ctl, arg);
+	} while (ret == -1 && errno == EINTR && num_tries-- > 0);
+	return ret;
+}
+
+static int get_v4l2_colorspace(std::optional<libcamera::ColorSpace> const &cs)
+{
+	if (cs == libcamera::ColorSpace::Rec709)
+		return V4L2_COLORSPACE_REC709;
+	else if (cs == libcamera::ColorSpace::Smpte170m)
+		return V4L2_COLORSPACE_SMPTE170M;
+
+	std::cerr << "V4L2Encoder: surprising colour space: " << libcamera::ColorSpace::toString(cs) << std::endl;
+	return V4L2_COLORSPACE_SMPTE170M;
+}
+
+static std::string fourcc_name(uint32_t fourcc)
+{
+	std::string name;
+	for (int i = 0; i < 4; i++)
+		name += (char)((fourcc >> (8 * i)) & 0xff);
+	return name;
+}
+
+static bool has_format(int fd, v4l2_buf_type type, uint32_t pixelformat)
+{
+	v4l2_fmtdesc desc = {};
+	desc.type = type;
+	for (desc.index = 0; xioctl(fd, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++)
+	{
+		if (desc.pixelformat == pixelformat)
+			return true;
+	}
+	return false;
+}
+
+// Returns 1 for a multi-planar encoder, 0 for a single-planar one, and -1 if the device
+// can't encode YUV420 to the codec at all.
+static int check_device(int fd, uint32_t codec)
+{
+	v4l2_capability caps = {};
+	if (xioctl(fd, VIDIOC_QUERYCAP, &caps) < 0)
+		return -1;
+	uint32_t device_caps = caps.capabilities & V4L2_CAP_DEVICE_CAPS ? caps.device_caps : caps.capabilities;
+	if (!(device_caps & V4L2_CAP_STREAMING))
+		return -1;
+
+	if ((device_caps & V4L2_CAP_VIDEO_M2M_MPLANE) &&
+		has_format(fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_PIX_FMT_YUV420) &&
+		has_format(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, codec))
+		return 1;
+	if ((device_caps & V4L2_CAP_VIDEO_M2M) && has_format(fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, V4L2_PIX_FMT_YUV420) &&
+		has_format(fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, codec))
+		return 0;
+	return -1;
+}
+
+void V4L2Encoder::openDevice(uint32_t codec, char const *preferred_device)
+{
+	std::vector<std::string> devices;
+	if (preferred_device)
+		devices.push_back(preferred_device);
+	for (int i = 0; i < 64; i++)
+		devices.push_back("/dev/video" + std::to_string(i));
+
+	for (auto const &device : devices)
+	{
+		fd_ = open(device.c_str(), O_RDWR, 0);
+		if (fd_ < 0)
+			continue;
+		int mplane = check_device(fd_, codec);
+		if (mplane >= 0)
+		{
+			mplane_ = mplane;
+			device_name_ = device;
+			return;
+		}
+		close(fd_);
+	}
+
+	throw std::runtime_error("failed to find a V4L2 " + fourcc_name(codec) + " encoder");
+}
+
+void V4L2Encoder::initBuffer(v4l2_buffer &buf, v4l2_plane *planes, bool capture, unsigned int memory) const
+{
+	buf = {};
+	buf.memory = memory;
+	if (mplane_)
+	{
+		memset(planes, 0, sizeof(v4l2_plane) * VIDEO_MAX_PLANES);
+		buf.type = capture ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		buf.length = 1;
+		buf.m.planes = planes;
+	}
+	else
+		buf.type = capture ? V4L2_BUF_TYPE_VIDEO_CAPTURE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+}
+
+V4L2Encoder::V4L2Encoder(VideoOptions const *options, StreamInfo const &info, uint32_t codec,
+						 char const *preferred_device)
+	: Encoder(options), abortPoll_(false), abortOutput_(false), dropped_(0), errors_(0), frames_(0)
+{
+	openDevice(codec, preferred_device);
+	if (options->verbose)
+		std::cerr << "Opened V4L2Encoder (" << fourcc_name(codec) << ") on " << device_name_ << " as fd " << fd_
+				  << (mplane_ ? "" : " (single-planar)") << std::endl;
+
+	// Apply any options->
+
+	v4l2_control ctrl = {};
+	if (options->bitrate)
+	{
+		ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+		ctrl.value = options->bitrate;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			throw std::runtime_error("failed to set bitrate");
+	}
+	if (codec == V4L2_PIX_FMT_H264)
+	{
+		if (!options->profile.empty())
+		{
+			static const std::map<std::string, int> profile_map =
+				{ { "baseline", V4L2_MPEG_VIDEO_H264_PROFILE_BASELINE },
+				  { "main", V4L2_MPEG_VIDEO_H264_PROFILE_MAIN },
+				  { "high", V4L2_MPEG_VIDEO_H264_PROFILE_HIGH } };
+			auto it = profile_map.find(options->profile);
+			if (it == profile_map.end())
+				throw std::runtime_error("no such profile " + options->profile);
+			ctrl.id = V4L2_CID_MPEG_VIDEO_H264_PROFILE;
+			ctrl.value = it->second;
+			if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+				throw std::runtime_error("failed to set profile");
+		}
+		if (!options->level.empty())
+		{
+			static const std::map<std::string, int> level_map =
+				{ { "4", V4L2_MPEG_VIDEO_H264_LEVEL_4_0 },
+				  { "4.1", V4L2_MPEG_VIDEO_H264_LEVEL_4_1 },
+				  { "4.2", V4L2_MPEG_VIDEO_H264_LEVEL_4_2 } };
+			auto it = level_map.find(options->level);
+			if (it == level_map.end())
+				throw std::runtime_error("no such level " + options->level);
+			ctrl.id = V4L2_CID_MPEG_VIDEO_H264_LEVEL;
+			ctrl.value = it->second;
+			if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+				throw std::runtime_error("failed to set level");
+		}
+	}
+	if (options->intra)
+	{
+		// Other codecs only have the generic GOP size control.
+		ctrl.id = codec == V4L2_PIX_FMT_H264 ? V4L2_CID_MPEG_VIDEO_H264_I_PERIOD : V4L2_CID_MPEG_VIDEO_GOP_SIZE;
+		ctrl.value = options->intra;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			throw std::runtime_error("failed to set intra period");
+	}
+	if (options->inline_headers)
+	{
+		ctrl.id = V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER;
+		ctrl.value = 1;
+		if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+			throw std::runtime_error("failed to set inline headers");
+	}
+
+	v4l2_queryctrl query = {};
+	query.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+	can_force_keyframe_ = xioctl(fd_, VIDIOC_QUERYCTRL, &query) == 0 && !(query.flags & V4L2_CTRL_FLAG_DISABLED);
+
+	// Set the output and capture formats. We know exactly what they will be.
+
+	v4l2_format fmt = {};
+	if (mplane_)
+	{
+		fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		fmt.fmt.pix_mp.width = info.width;
+		fmt.fmt.pix_mp.height = info.height;
+		// We assume YUV420 here, but it would be nice if we could do something
+		// like info.pixel_format.toV4L2Fourcc();
+		fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_YUV420;
+		fmt.fmt.pix_mp.plane_fmt[0].bytesperline = info.stride;
+		fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+		fmt.fmt.pix_mp.colorspace = get_v4l2_colorspace(info.colour_space);
+		fmt.fmt.pix_mp.num_planes = 1;
+	}
+	else
+	{
+		fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		fmt.fmt.pix.width = info.width;
+		fmt.fmt.pix.height = info.height;
+		fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUV420;
+		fmt.fmt.pix.bytesperline = info.stride;
+		fmt.fmt.pix.field = V4L2_FIELD_ANY;
+		fmt.fmt.pix.colorspace = get_v4l2_colorspace(info.colour_space);
+	}
+	if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0)
+		throw std::runtime_error("failed to set output format");
+	// The codec reads the camera's buffers directly, so it must agree about their layout.
+	unsigned int stride = mplane_ ? fmt.fmt.pix_mp.plane_fmt[0].bytesperline : fmt.fmt.pix.bytesperline;
+	if (stride != info.stride)
+		throw std::runtime_error("encoder wants stride " + std::to_string(stride) + " but images have stride " +
+								 std::to_string(info.stride));
+
+	// Size the encoded buffers for a keyframe, which may be many times the average frame
+	// size at our bitrate, but which needn't be bigger than the uncompressed image.
+	float framerate = options->framerate > 0 ? options->framerate : 30;
+	size_t image_bytes = info.stride * info.height * 3 / 2;
+	size_t average_bytes = options->bitrate ? options->bitrate / 8 / framerate : image_bytes / 10;
+	size_t sizeimage = std::max<size_t>(std::min(10 * average_bytes, image_bytes), 512 << 10);
+	sizeimage = (sizeimage + 4095) & ~4095;
+
+	fmt = {};
+	if (mplane_)
+	{
+		fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		fmt.fmt.pix_mp.width = options->width;
+		fmt.fmt.pix_mp.height = options->height;
+		fmt.fmt.pix_mp.pixelformat = codec;
+		fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+		fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_DEFAULT;
+		fmt.fmt.pix_mp.num_planes = 1;
+		fmt.fmt.pix_mp.plane_fmt[0].bytesperline = 0;
+		fmt.fmt.pix_mp.plane_fmt[0].sizeimage = sizeimage;
+	}
+	else
+	{
+		fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		fmt.fmt.pix.width = options->width;
+		fmt.fmt.pix.height = options->height;
+		fmt.fmt.pix.pixelformat = codec;
+		fmt.fmt.pix.field = V4L2_FIELD_ANY;
+		fmt.fmt.pix.colorspace = V4L2_COLORSPACE_DEFAULT;
+		fmt.fmt.pix.bytesperline = 0;
+		fmt.fmt.pix.sizeimage = sizeimage;
+	}
+	if (xioctl(fd_, VIDIOC_S_FMT, &fmt) < 0)
+		throw std::runtime_error("failed to set capture format");
+
+	// Request that the necessary buffers are allocated. The output queue
+	// (input to the encoder) shares buffers from our caller, these must be
+	// DMABUFs. Buffers for the encoded bitstream must be allocated and
+	// m-mapped.
+
+	v4l2_requestbuffers reqbufs = {};
+	reqbufs.count = NUM_OUTPUT_BUFFERS;
+	reqbufs.type = mplane_ ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	reqbufs.memory = V4L2_MEMORY_DMABUF;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		throw std::runtime_error("request for output buffers failed");
+	if (options->verbose)
+		std::cerr << "Got " << reqbufs.count << " output buffers" << std::endl;
+
+	// We have to maintain a list of the buffers we can use when our caller gives
+	// us another frame to encode.
+	num_output_buffers_ = std::min<int>(reqbufs.count, NUM_OUTPUT_BUFFERS);
+	for (int i = 0; i < num_output_buffers_; i++)
+		input_buffers_available_.push(i);
+
+	// Enough encoded buffers to ride out half a second's delay in the output, so long as
+	// that doesn't take an unreasonable amount of memory.
+	int num_capture_buffers = std::clamp<int>(framerate / 2 + 1, MIN_CAPTURE_BUFFERS, MAX_CAPTURE_BUFFERS);
+	num_capture_buffers = std::min<int>(num_capture_buffers, std::max<int>((64 << 20) / sizeimage, 4));
+
+	reqbufs = {};
+	reqbufs.count = num_capture_buffers;
+	reqbufs.type = mplane_ ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	reqbufs.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		throw std::runtime_error("request for capture buffers failed");
+	if (options->verbose)
+		std::cerr << "Got " << reqbufs.count << " capture buffers of " << sizeimage << " bytes" << std::endl;
+	buffers_.resize(reqbufs.count);
+
+	size_t capture_bytes = 0;
+	for (unsigned int i = 0; i < buffers_.size(); i++)
+	{
+		v4l2_plane planes[VIDEO_MAX_PLANES];
+		v4l2_buffer buffer;
+		initBuffer(buffer, planes, true, V4L2_MEMORY_MMAP);
+		buffer.index = i;
+		if (xioctl(fd_, VIDIOC_QUERYBUF, &buffer) < 0)
+			throw std::runtime_error("failed to capture query buffer " + std::to_string(i));
+		size_t length = mplane_ ? buffer.m.planes[0].length : buffer.length;
+		off_t offset = mplane_ ? buffer.m.planes[0].m.mem_offset : buffer.m.offset;
+		buffers_[i].mem = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, offset);
+		if (buffers_[i].mem == MAP_FAILED)
+			throw std::runtime_error("failed to mmap capture buffer " + std::to_string(i));
+		buffers_[i].size = length;
+		capture_bytes += buffers_[i].size;
+		// Whilst we're going through all the capture buffers, we may as well queue
+		// them ready for the encoder to write into.
+		if (xioctl(fd_, VIDIOC_QBUF, &buffer) < 0)
+			throw std::runtime_error("failed to queue capture buffer " + std::to_string(i));
+	}
+
+	memory_report_name_ = "V4L2 " + fourcc_name(codec) + " capture buffers x" + std::to_string(buffers_.size());
+	memory_report_set(memory_report_name_, capture_bytes);
+
+	// Enable streaming and we're done.
+
+	v4l2_buf_type type = mplane_ ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0)
+		throw std::runtime_error("failed to start output streaming");
+	type = mplane_ ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (xioctl(fd_, VIDIOC_STREAMON, &type) < 0)
+		throw std::runtime_error("failed to start capture streaming");
+	if (options->verbose)
+		std::cerr << "Codec streaming started" << std::endl;
+
+	// The poll thread also watches this, so that we can wake it up to quit.
+	abort_poll_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (abort_poll_fd_ < 0)
+		throw std::runtime_error("failed to create eventfd");
+
+	output_thread_ = std::thread(&V4L2Encoder::outputThread, this);
+	poll_thread_ = std::thread(&V4L2Encoder::pollThread, this);
+}
+
+V4L2Encoder::~V4L2Encoder()
+{
+	abortPoll_ = true;
+	uint64_t one = 1;
+	if (write(abort_poll_fd_, &one, sizeof(one)) < 0)
+		std::cerr << "Failed to wake poll thread" << std::endl;
+	poll_thread_.join();
+	close(abort_poll_fd_);
+	{
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		abortOutput_ = true;
+		output_cond_var_.notify_one();
+	}
+	output_thread_.join();
+
+	// Turn off streaming on both the output and capture queues, and "free" the
+	// buffers that we requested. The capture ones need to be "munmapped" first.
+
+	v4l2_buf_type type = mplane_ ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	if (xioctl(fd_, VIDIOC_STREAMOFF, &type) < 0)
+		std::cerr << "Failed to stop output streaming" << std::endl;
+	type = mplane_ ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (xioctl(fd_, VIDIOC_STREAMOFF, &type) < 0)
+		std::cerr << "Failed to stop capture streaming" << std::endl;
+
+	v4l2_requestbuffers reqbufs = {};
+	reqbufs.count = 0;
+	reqbufs.type = mplane_ ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	reqbufs.memory = V4L2_MEMORY_DMABUF;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		std::cerr << "Request to free output buffers failed" << std::endl;
+
+	for (auto &buffer : buffers_)
+		if (munmap(buffer.mem, buffer.size) < 0)
+			std::cerr << "Failed to unmap buffer" << std::endl;
+	memory_report_set(memory_report_name_, 0);
+	reqbufs = {};
+	reqbufs.count = 0;
+	reqbufs.type = mplane_ ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	reqbufs.memory = V4L2_MEMORY_MMAP;
+	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+		std::cerr << "Request to free capture buffers failed" << std::endl;
+
+	close(fd_);
+	if (options_->verbose)
+	{
+		if (dropped_ || errors_)
+			std::cerr << "V4L2Encoder dropped " << dropped_ << " frames (queue full) and " << errors_
+					  << " frames (encode errors)" << std::endl;
+		std::cerr << "V4L2Encoder closed after encoding " << frames_ << " frames" << std::endl;
+	}
+}
+
+void V4L2Encoder::SetBitrate(uint32_t bitrate)
+{
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+	ctrl.value = bitrate;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+		throw std::runtime_error("failed to set bitrate");
+}
+
+void V4L2Encoder::RequestKeyframe()
+{
+	// Codecs that can't do this will just have to wait for their next natural keyframe.
+	if (!can_force_keyframe_)
+		return;
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+	ctrl.value = 1;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+		throw std::runtime_error("failed to force keyframe");
+}
+
+void V4L2Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+{
+	int index = -1;
+	void *drop_mem = nullptr;
+	{
+		// We need to find an available output buffer (input to the codec) to
+		// "wrap" the DMABUF. If there isn't one, the frame waits its turn, unless
+		// too many are waiting already, in which case we drop one of them.
+		std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
+		if (input_buffers_available_.empty())
+		{
+			if (pending_queue_.size() < options_->encoder_queue)
+			{
+				pending_queue_.push(PendingItem { fd, size, mem, timestamp_us });
+				return;
+			}
+			dropped_++;
+			Stats()->Dropped();
+			if (options_->encoder_drop == "oldest" && !pending_queue_.empty())
+			{
+				drop_mem = pending_queue_.pop_front().mem;
+				pending_queue_.push(PendingItem { fd, size, mem, timestamp_us });
+			}
+			else
+				drop_mem = mem;
+		}
+		else
+		{
+			index = input_buffers_available_.front();
+			input_buffers_available_.pop();
+			input_mem_[index] = mem;
+		}
+	}
+
+	if (drop_mem)
+		input_done_callback_(drop_mem);
+	else
+		queueInput(index, fd, size, timestamp_us);
+}
+
+void V4L2Encoder::queueInput(int index, int fd, size_t size, int64_t timestamp_us)
+{
+	v4l2_buffer buf;
+	v4l2_plane planes[VIDEO_MAX_PLANES];
+	initBuffer(buf, planes, false, V4L2_MEMORY_DMABUF);
+	buf.index = index;
+	buf.field = V4L2_FIELD_NONE;
+	buf.timestamp.tv_sec = timestamp_us / 1000000;
+	buf.timestamp.tv_usec = timestamp_us % 1000000;
+	if (mplane_)
+	{
+		buf.m.planes[0].m.fd = fd;
+		buf.m.planes[0].bytesused = size;
+		buf.m.planes[0].length = size;
+	}
+	else
+	{
+		buf.m.fd = fd;
+		buf.bytesused = size;
+		buf.length = size;
+	}
+	if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
+		throw std::runtime_error("failed to queue input to codec");
+}
+
+void V4L2Encoder::queueCapture(unsigned int index, size_t length)
+{
+	v4l2_buffer buf;
+	v4l2_plane planes[VIDEO_MAX_PLANES];
+	initBuffer(buf, planes, true, V4L2_MEMORY_MMAP);
+	buf.index = index;
+	if (mplane_)
+	{
+		buf.m.planes[0].bytesused = 0;
+		buf.m.planes[0].length = length;
+	}
+	else
+		buf.length = length;
+	if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
+		throw std::runtime_error("failed to re-queue encoded buffer");
+}
+
+void V4L2Encoder::pollThread()
+{
+	while (true)
+	{
+		// Once asked to quit, we only wait for the codec to give back all the input buffers.
+		// Read the flag just once: if it were set between here and the poll, we'd stop
+		// watching the eventfd only to wait forever for buffers that are already back.
+		bool abort = abortPoll_;
+		{
+			std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
+			if (abort && (int)input_buffers_available_.size() == num_output_buffers_)
+				break;
+		}
+		pollfd p[2] = { { fd_, POLLIN, 0 }, { abort_poll_fd_, POLLIN, 0 } };
+		int ret = poll(p, abort ? 1 : 2, -1);
+		if (ret == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("unexpected errno " + std::to_string(errno) + " from poll");
+		}
+		if (p[0].revents & POLLIN)
+		{
+			v4l2_buffer buf;
+			v4l2_plane planes[VIDEO_MAX_PLANES];
+			initBuffer(buf, planes, false, V4L2_MEMORY_DMABUF);
+			int ret = xioctl(fd_, VIDIOC_DQBUF, &buf);
+			if (ret == 0)
+			{
+				// Return this to the caller, first noting that this buffer, identified
+				// by its index, is available for queueing up another frame (or goes
+				// straight to the next frame that's waiting).
+				void *mem;
+				PendingItem next = {};
+				{
+					std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
+					mem = input_mem_[buf.index];
+					if (pending_queue_.empty())
+						input_buffers_available_.push(buf.index);
+					else
+					{
+						next = pending_queue_.pop_front();
+						input_mem_[buf.index] = next.mem;
+					}
+				}
+				input_done_callback_(mem);
+				if (next.mem)
+					queueInput(buf.index, next.fd, next.size, next.timestamp_us);
+			}
+
+			initBuffer(buf, planes, true, V4L2_MEMORY_MMAP);
+			ret = xioctl(fd_, VIDIOC_DQBUF, &buf);
+			if (ret == 0 && (buf.flags & V4L2_BUF_FLAG_ERROR))
+			{
+				// Probably the frame didn't fit. Lose it rather than pass on a broken one.
+				errors_++;
+				Stats()->Dropped();
+				queueCapture(buf.index, mplane_ ? buf.m.planes[0].length : buf.length);
+			}
+			else if (ret == 0)
+			{
+				// We push this encoded buffer to another thread so that our
+				// application can take its time with the data without blocking the
+				// encode process.
+				int64_t timestamp_us = (buf.timestamp.tv_sec * (int64_t)1000000) + buf.timestamp.tv_usec;
+				OutputItem item = { buffers_[buf.index].mem,
+									mplane_ ? buf.m.planes[0].bytesused : buf.bytesused,
+									mplane_ ? buf.m.planes[0].length : buf.length,
+									buf.index,
+									!!(buf.flags & V4L2_BUF_FLAG_KEYFRAME),
+									timestamp_us };
+				std::lock_guard<std::mutex> lock(output_mutex_);
+				output_queue_.push(item);
+				output_cond_var_.notify_one();
+			}
+		}
+	}
+}
+
+void V4L2Encoder::outputThread()
+{
+	OutputItem item;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(output_mutex_);
+			while (true)
+			{
+				// Must check the abort first, to allow items in the output
+				// queue to have a callback.
+				if (abortOutput_ && output_queue_.empty())
+					return;
+
+				if (!output_queue_.empty())
+				{
+					item = output_queue_.front();
+					output_queue_.pop();
+					break;
+				}
+				else
+					output_cond_var_.wait(lock);
+			}
+		}
+
+		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, item.keyframe);
+		frames_++;
+		queueCapture(item.index, item.length);
+	}
+}
@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * v4l2_encoder.hpp - V4L2 memory-to-memory video encoder.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <linux/videodev2.h>
+
+#include "core/recycling_queue.hpp"
+
+#include "encoder.hpp"
+
+// Drives any stateful V4L2 memory-to-memory encoder that takes YUV420 and produces the
+// given coded format (a V4L2 fourcc). We try the preferred device first (if any), and
+// otherwise look for one whose capabilities and formats fit. Single and multi-planar
+// drivers both work, so this can be tested with the kernel's "vicodec" (FWHT) driver
+// on machines without a hardware encoder.
+
+class V4L2Encoder : public Encoder
+{
+public:
+	V4L2Encoder(VideoOptions const *options, StreamInfo const &info, uint32_t codec,
+				char const *preferred_device = nullptr);
+	~V4L2Encoder();
+	// Encode the given DMABUF.
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	void SetBitrate(uint32_t bitrate) override;
+	void RequestKeyframe() override;
+
+private:
+	// We want at least as many output buffers as there are in the camera queue
+	// (we always want to be able to queue them when they arrive). Frames that
+	// arrive when they're all busy wait in a short queue, or get dropped. The
+	// capture buffers are our buffering mechanism in case of delays dealing with
+	// the output bitstream, so we make enough for a fraction of a second's worth.
+	static constexpr int NUM_OUTPUT_BUFFERS = 6;
+	static constexpr int MIN_CAPTURE_BUFFERS = 6;
+	static constexpr int MAX_CAPTURE_BUFFERS = 32;
+
+	// Open the first device that can encode YUV420 to our codec.
+	void openDevice(uint32_t codec, char const *preferred_device);
+	// Set up buffer (and plane) structures for the given queue, whichever API the driver uses.
+	void initBuffer(v4l2_buffer &buf, v4l2_plane *planes, bool capture, unsigned int memory) const;
+	void queueInput(int index, int fd, size_t size, int64_t timestamp_us);
+	void queueCapture(unsigned int index, size_t length);
+
+	// This thread just sits waiting for the encoder to finish stuff. It will either:
+	// * receive "output" buffers (codec inputs), which we must return to the caller
+	// * receive encoded buffers, which we pass to the application.
+	void pollThread();
+
+	// Handle the output buffers in another thread so as not to block the encoder. The
+	// application can take its time, after which we return this buffer to the encoder for
+	// re-use.
+	void outputThread();
+
+	std::atomic<bool> abortPoll_;
+	bool abortOutput_;
+	int fd_;
+	int abort_poll_fd_;
+	bool mplane_;
+	bool can_force_keyframe_;
+	std::string device_name_;
+	std::string memory_report_name_;
+	struct BufferDescription
+	{
+		void *mem;
+		size_t size;
+	};
+	std::vector<BufferDescription> buffers_;
+	int num_output_buffers_;
+	std::thread poll_thread_;
+	std::mutex input_buffers_available_mutex_;
+	RecyclingQueue<int> input_buffers_available_;
+	// Frames waiting for the codec to give back an input buffer.
+	struct PendingItem
+	{
+		int fd;
+		size_t size;
+		void *mem;
+		int64_t timestamp_us;
+	};
+	RecyclingQueue<PendingItem> pending_queue_;
+	std::atomic<uint64_t> dropped_; // because the pending queue was full
+	std::atomic<uint64_t> errors_; // encoded frames the codec flagged as bad (e.g. buffer overflowed)
+	// The caller's buffer that each codec input buffer is wrapping.
+	void *input_mem_[NUM_OUTPUT_BUFFERS];
+	struct OutputItem
+	{
+		void *mem;
+		size_t bytes_used;
+		size_t length;
+		unsigned int index;
+		bool keyframe;
+		int64_t timestamp_us;
+	};
+	RecyclingQueue<OutputItem> output_queue_;
+	std::mutex output_mutex_;
+	std::condition_variable output_cond_var_;
+	std::thread output_thread_;
+	unsigned int frames_;
+};
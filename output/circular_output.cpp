@@ -5,6 +5,8 @@
  * circular_output.cpp - Write output to circular buffer which we save on exit.
  */
 
+#include "core/memory_report.hpp"
+
 #include "circular_output.hpp"
 
 // We're going to align the frames within the buffer to friendly byte boundaries
@@ -30,6 +32,8 @@ CircularOutput::CircularOutput(VideoOptions const *options) : Output(options), c
 	}
 	if (!fp_)
 		throw std::runtime_error("could not open output file");
+
+	memory_report_set("circular buffer", cb_.Size());
 }
 
 CircularOutput::~CircularOutput()
@@ -61,6 +65,7 @@ CircularOutput::~CircularOutput()
 			cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
 	}
 	fclose(fp_);
+	memory_report_set("circular buffer", 0);
 	std::cerr << "Wrote " << total << " bytes (" << frames << " frames)" << std::endl;
 }
 
@@ -8,7 +8,7 @@
 #include "file_output.hpp"
 
 FileOutput::FileOutput(VideoOptions const *options)
-	: Output(options), fp_(nullptr), count_(0), file_start_time_ms_(0)
+	: Output(options), fp_(nullptr), count_(0), file_start_time_ms_(0), last_timestamp_us_(0)
 {
 }
 
@@ -31,6 +31,15 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 		openFile(timestamp_us);
 	}
 
+	// Ask for the keyframe that starts the next segment as it becomes due, so segments
+	// don't depend on the intra period. Go by the interval between the frames we actually
+	// get, as the framerate may be variable (or unknown).
+	int64_t frame_interval_ms = last_timestamp_us_ ? (timestamp_us - last_timestamp_us_) / 1000 : 0;
+	last_timestamp_us_ = timestamp_us;
+	if (options_->segment && !(flags & FLAG_KEYFRAME) &&
+		timestamp_us / 1000 - file_start_time_ms_ + frame_interval_ms > options_->segment)
+		requestKeyframe();
+
 	if (options_->verbose)
 		std::cerr << "FileOutput: output buffer " << mem << " size " << size << "\n";
 	if (fp_ && size)
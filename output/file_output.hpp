@@ -24,4 +24,5 @@ private:
 	FILE *fp_;
 	unsigned int count_;
 	int64_t file_start_time_ms_;
+	int64_t last_timestamp_us_;
 };
@@ -0,0 +1,191 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * metadata_writer.cpp - write per-frame metadata to a binary sidecar file.
+ */
+
+#include <any>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include <libcamera/control_ids.h>
+
+#include "post_processing_stages/object_detect.hpp"
+
+#include "metadata_writer.hpp"
+
+using namespace libcamera;
+
+MetadataWriter::MetadataWriter(std::string const &filename) : abort_(false)
+{
+	fp_ = fopen(filename.c_str(), "wb");
+	if (!fp_)
+		throw std::runtime_error("Failed to open metadata file " + filename);
+
+	MetadataFileHeader header = {};
+	memcpy(header.magic, "LCMETA", 6);
+	header.version = 1;
+	header.header_size = sizeof(MetadataFileHeader);
+	header.record_size = sizeof(MetadataRecord);
+	header.entry_size = sizeof(MetadataEntry);
+	header.max_entries = MetadataRecord::MAX_ENTRIES;
+	if (fwrite(&header, sizeof(header), 1, fp_) != 1)
+		throw std::runtime_error("Failed to write metadata file header");
+
+	thread_ = std::thread(&MetadataWriter::writerThread, this);
+}
+
+MetadataWriter::~MetadataWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_var_.notify_one();
+	thread_.join();
+	fclose(fp_);
+}
+
+static MetadataEntry *add_entry(MetadataRecord &record, std::string const &key, MetadataEntry::Type type,
+								unsigned int index)
+{
+	if (record.num_entries == MetadataRecord::MAX_ENTRIES)
+	{
+		record.dropped_entries++;
+		return nullptr;
+	}
+	MetadataEntry &entry = record.entries[record.num_entries++];
+	strncpy(entry.key, key.c_str(), sizeof(entry.key) - 1);
+	entry.type = type;
+	entry.index = index;
+	return &entry;
+}
+
+static void add_scalar(MetadataRecord &record, std::string const &tag, float value, unsigned int index = 0)
+{
+	MetadataEntry *entry = add_entry(record, tag, MetadataEntry::SCALAR, index);
+	if (entry)
+		entry->value[0] = value;
+}
+
+// Turn whatever post-processing metadata types we understand into entries. Other
+// types are skipped.
+static void add_entries(MetadataRecord &record, std::string const &tag, std::any const &value)
+{
+	if (auto v = std::any_cast<bool>(&value))
+		add_scalar(record, tag, *v);
+	else if (auto v = std::any_cast<int>(&value))
+		add_scalar(record, tag, *v);
+	else if (auto v = std::any_cast<unsigned int>(&value))
+		add_scalar(record, tag, *v);
+	else if (auto v = std::any_cast<float>(&value))
+		add_scalar(record, tag, *v);
+	else if (auto v = std::any_cast<double>(&value))
+		add_scalar(record, tag, *v);
+	else if (auto v = std::any_cast<std::vector<float>>(&value))
+	{
+		for (unsigned int i = 0; i < v->size(); i++)
+			add_scalar(record, tag, (*v)[i], i);
+	}
+	else if (auto v = std::any_cast<std::vector<Detection>>(&value))
+	{
+		for (unsigned int i = 0; i < v->size(); i++)
+		{
+			Detection const &d = (*v)[i];
+			MetadataEntry *entry = add_entry(record, tag, MetadataEntry::DETECTION, i);
+			if (!entry)
+				break;
+			float values[] = { (float)d.category, d.confidence, (float)d.box.x, (float)d.box.y,
+							   (float)d.box.width, (float)d.box.height };
+			memcpy(entry->value, values, sizeof(values));
+		}
+	}
+	else if (auto v = std::any_cast<std::vector<Point>>(&value))
+	{
+		for (unsigned int i = 0; i < v->size(); i++)
+		{
+			MetadataEntry *entry = add_entry(record, tag, MetadataEntry::POINT, i);
+			if (!entry)
+				break;
+			entry->value[0] = (*v)[i].x;
+			entry->value[1] = (*v)[i].y;
+		}
+	}
+	else if (auto v = std::any_cast<std::vector<std::pair<std::string, float>>>(&value))
+	{
+		for (unsigned int i = 0; i < v->size(); i++)
+		{
+			MetadataEntry *entry = add_entry(record, tag + ":" + (*v)[i].first, MetadataEntry::CLASSIFICATION, i);
+			if (!entry)
+				break;
+			entry->value[0] = (*v)[i].second;
+		}
+	}
+}
+
+void MetadataWriter::Write(CompletedRequest const &completed_request, int64_t timestamp_us)
+{
+	MetadataRecord record = {};
+	ControlList const &ctrls = completed_request.metadata;
+
+	record.sequence = completed_request.sequence;
+	record.timestamp_us = timestamp_us;
+	record.exposure_time = record.analogue_gain = record.digital_gain = NAN;
+	record.colour_gains[0] = record.colour_gains[1] = NAN;
+	record.lux = record.colour_temperature = record.focus = NAN;
+
+	if (ctrls.contains(controls::ExposureTime))
+		record.exposure_time = ctrls.get(controls::ExposureTime);
+	if (ctrls.contains(controls::AnalogueGain))
+		record.analogue_gain = ctrls.get(controls::AnalogueGain);
+	if (ctrls.contains(controls::DigitalGain))
+		record.digital_gain = ctrls.get(controls::DigitalGain);
+	if (ctrls.contains(controls::ColourGains))
+	{
+		Span<const float> gains = ctrls.get(controls::ColourGains);
+		record.colour_gains[0] = gains[0], record.colour_gains[1] = gains[1];
+	}
+	if (ctrls.contains(controls::Lux))
+		record.lux = ctrls.get(controls::Lux);
+	if (ctrls.contains(controls::ColourTemperature))
+		record.colour_temperature = ctrls.get(controls::ColourTemperature);
+	if (ctrls.contains(controls::FocusFoM))
+		record.focus = ctrls.get(controls::FocusFoM);
+	if (ctrls.contains(controls::AeLocked) && ctrls.get(controls::AeLocked))
+		record.flags |= 1;
+
+	completed_request.post_process_metadata.ForEach(
+		[&record](std::string const &tag, std::any const &value) { add_entries(record, tag, value); });
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		queue_.push(record);
+	}
+	cond_var_.notify_one();
+}
+
+void MetadataWriter::writerThread()
+{
+	bool failed = false;
+	while (true)
+	{
+		MetadataRecord record;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_var_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+			if (queue_.empty())
+				return; // only get here when aborting, and everything has been written
+			record = queue_.pop_front();
+		}
+		// Carry on draining the queue after a failure, but don't keep complaining.
+		if (!failed && fwrite(&record, sizeof(record), 1, fp_) != 1)
+		{
+			std::cerr << "WARNING: failed to write metadata record " << record.sequence << std::endl;
+			failed = true;
+		}
+	}
+}
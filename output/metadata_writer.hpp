@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2021, Raspberry Pi (Trading) Ltd.
+ *
+ * metadata_writer.hpp - write per-frame metadata to a binary sidecar file.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "core/completed_request.hpp"
+#include "core/recycling_queue.hpp"
+
+// The file is a MetadataFileHeader followed by fixed-size MetadataRecords, one per
+// frame, in order of increasing sequence number and timestamp. So it can be mmapped
+// and any frame found by indexing or a binary search (see utils/metadata_reader.py).
+// Everything is little-endian, as written by the Pi. Values that the camera didn't
+// report are NaN.
+
+struct MetadataFileHeader
+{
+	char magic[8]; // "LCMETA\0\0"
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t record_size;
+	uint32_t entry_size;
+	uint32_t max_entries;
+	uint32_t reserved[9];
+};
+static_assert(sizeof(MetadataFileHeader) == 64, "MetadataFileHeader should be 64 bytes");
+
+// An item from the post-processing metadata. Lists of results (such as detections)
+// take one entry per list element, distinguished by the index.
+struct MetadataEntry
+{
+	enum Type : uint32_t
+	{
+		SCALAR = 1, // value[0]
+		DETECTION = 2, // category, confidence, x, y, width, height
+		POINT = 3, // x, y
+		CLASSIFICATION = 4, // confidence (the label goes in the key after the tag and a ':')
+	};
+	char key[32]; // NUL-terminated, truncated if necessary
+	uint32_t type;
+	uint32_t index;
+	float value[6];
+};
+static_assert(sizeof(MetadataEntry) == 64, "MetadataEntry should be 64 bytes");
+
+struct MetadataRecord
+{
+	static constexpr unsigned int MAX_ENTRIES = 15;
+	uint64_t sequence;
+	int64_t timestamp_us; // sensor timestamp, as given to the encoder
+	float exposure_time; // microseconds
+	float analogue_gain;
+	float digital_gain;
+	float colour_gains[2]; // red, blue
+	float lux;
+	float colour_temperature;
+	float focus;
+	uint32_t flags; // bit 0: AE locked
+	uint32_t num_entries; // valid entries in the array below
+	uint32_t dropped_entries; // entries that didn't fit
+	uint32_t reserved;
+	MetadataEntry entries[MAX_ENTRIES];
+};
+static_assert(sizeof(MetadataRecord) == 1024, "MetadataRecord should be 1024 bytes");
+
+class MetadataWriter
+{
+public:
+	MetadataWriter(std::string const &filename);
+	~MetadataWriter();
+	// Fill in a record from this request, and queue it for the background thread to write.
+	void Write(CompletedRequest const &completed_request, int64_t timestamp_us);
+
+private:
+	void writerThread();
+
+	FILE *fp_;
+	bool abort_;
+	RecyclingQueue<MetadataRecord> queue_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::thread thread_;
+};
@@ -14,7 +14,8 @@
 #include "output.hpp"
 
 Output::Output(VideoOptions const *options)
-	: options_(options), state_(WAITING_KEYFRAME), fp_timestamps_(nullptr), time_offset_(0), last_timestamp_(0)
+	: options_(options), state_(WAITING_KEYFRAME), restart_(false), fp_timestamps_(nullptr), time_offset_(0),
+	  last_timestamp_(0), keyframe_requested_(false)
 {
 	if (!options->save_pts.empty())
 	{
@@ -42,6 +43,10 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 {
 	// When output is enabled, we may have to wait for the next keyframe.
 	uint32_t flags = keyframe ? FLAG_KEYFRAME : FLAG_NONE;
+	if (keyframe)
+		keyframe_requested_ = false;
+	if (restart_.exchange(false) && state_ == RUNNING)
+		state_ = WAITING_KEYFRAME;
 	if (!enable_)
 		state_ = DISABLED;
 	else if (state_ == DISABLED)
@@ -49,7 +54,12 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 	if (state_ == WAITING_KEYFRAME && keyframe)
 		state_ = RUNNING, flags |= FLAG_RESTART;
 	if (state_ != RUNNING)
+	{
+		// Rather than wait for the next natural keyframe, ask for one straight away.
+		if (state_ == WAITING_KEYFRAME)
+			requestKeyframe();
 		return;
+	}
 
 	// Frig the timestamps to be continuous after a pause.
 	if (flags & FLAG_RESTART)
@@ -63,6 +73,15 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 		fprintf(fp_timestamps_, "%" PRId64 ".%03" PRId64 "\n", last_timestamp_ / 1000, last_timestamp_ % 1000);
 }
 
+void Output::requestKeyframe()
+{
+	if (!keyframe_requested_ && keyframe_request_callback_)
+	{
+		keyframe_requested_ = true;
+		keyframe_request_callback_();
+	}
+}
+
 void Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
 	// Supply this so that a vanilla Output gives you an object that outputs no buffers.
@@ -10,9 +10,12 @@
 #include <cstdio>
 
 #include <atomic>
+#include <functional>
 
 #include "core/video_options.hpp"
 
+typedef std::function<void()> KeyframeRequestCallback;
+
 class Output
 {
 public:
@@ -22,6 +25,13 @@ public:
 	virtual ~Output();
 	virtual void Signal(); // a derived class might redefine what this means
 	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
+	// Whether we want anything to output at the moment, or are paused.
+	bool Enabled() const { return enable_; }
+	// Start again from the next keyframe, as frames after a gap in encoding may refer to
+	// frames from before it.
+	void Restart() { restart_ = true; }
+	// How we ask the encoder for a keyframe, so that we needn't wait for the next natural one.
+	void SetKeyframeRequestCallback(KeyframeRequestCallback callback) { keyframe_request_callback_ = callback; }
 
 protected:
 	enum Flag
@@ -31,6 +41,8 @@ protected:
 		FLAG_RESTART = 2
 	};
 	virtual void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
+	// Make the encoder's next frame a keyframe. Repeated requests are ignored until it arrives.
+	void requestKeyframe();
 	VideoOptions const *options_;
 
 private:
@@ -42,7 +54,10 @@ private:
 	};
 	State state_;
 	std::atomic<bool> enable_;
+	std::atomic<bool> restart_;
 	FILE *fp_timestamps_;
 	int64_t time_offset_;
 	int64_t last_timestamp_;
+	KeyframeRequestCallback keyframe_request_callback_;
+	bool keyframe_requested_;
 };
@@ -10,6 +10,7 @@
 #include <libcamera/stream.h>
 
 #include "core/frame_info.hpp"
+#include "core/buffer_sync.hpp"
 #include "core/libcamera_app.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
@@ -80,7 +81,8 @@ void AnnotateCvStage::Configure()
 
 bool AnnotateCvStage::Process(CompletedRequestPtr &completed_request)
 {
-	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
 	FrameInfo info(completed_request->metadata);
 	info.sequence = completed_request->sequence;
 
@@ -15,6 +15,8 @@
 
 #include <libcamera/geometry.h>
 
+#include "core/buffer_sync.hpp"
+#include "core/executor.hpp"
 #include "core/libcamera_app.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
@@ -120,13 +122,14 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 		if (completed_request->sequence % refresh_rate_ == 0 &&
 			(!future_ptr_ || future_ptr_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
 		{
-			libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
+			BufferReadSync r(app_, completed_request->buffers[stream_], true);
+			libcamera::Span<uint8_t> buffer = r.Get()[0];
 			uint8_t *ptr = (uint8_t *)buffer.data();
 			Mat image(low_res_info_.height, low_res_info_.width, CV_8U, ptr, low_res_info_.stride);
 			image_ = image.clone();
 
 			future_ptr_ = std::make_unique<std::future<void>>();
-			*future_ptr_ = std::async(std::launch::async, [this] { detectFeatures(cascade_); });
+			*future_ptr_ = Executor::Get().Submit(Executor::ANALYTICS, [this] { detectFeatures(cascade_); });
 		}
 	}
 
@@ -139,7 +142,8 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 
 	if (draw_features_)
 	{
-		libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[full_stream_])[0];
+		BufferWriteSync w(app_, completed_request->buffers[full_stream_]);
+		libcamera::Span<uint8_t> buffer = w.Get()[0];
 		uint8_t *ptr = (uint8_t *)buffer.data();
 		Mat image(full_stream_info_.height, full_stream_info_.width, CV_8U, ptr, full_stream_info_.stride);
 		drawFeatures(image);
@@ -24,7 +24,10 @@
 
 #include <libcamera/stream.h>
 
+#include "core/buffer_sync.hpp"
+#include "core/executor.hpp"
 #include "core/libcamera_app.hpp"
+#include "core/memory_report.hpp"
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
@@ -124,7 +127,8 @@ void HdrImage::Accumulate(uint8_t const *src, int stride)
 {
 	int16_t *dest = &P(0);
 	int width2 = width / 2, stride2 = stride / 2;
-	std::thread thread1(add_Y_pixels, dest, src, width, stride, height);
+	auto y_pixels = Executor::Get().Submit(Executor::CAPTURE,
+										   [=]() { add_Y_pixels(dest, src, width, stride, height); });
 
 	dest += width * height;
 	src += stride * height;
@@ -138,7 +142,7 @@ void HdrImage::Accumulate(uint8_t const *src, int stride)
 
 	dynamic_range += 256;
 
-	thread1.join();
+	Executor::Get().Wait(y_pixels);
 }
 
 // Forward pass of the IIR low pass filter.
@@ -207,9 +211,10 @@ HdrImage HdrImage::LpFilter(LpFilterConfig const &config) const
 	HdrImage out(width, height, width * height);
 	out.dynamic_range = dynamic_range;
 
-	// Run the forward pass in other thread, so that the two passes run in parallel.
-	std::thread fwd_pass(forward_pass, std::ref(fwd_pixels), std::ref(fwd_weight_sums), std::ref(*this),
-						 std::ref(weights), std::ref(threshold), width, height, size, strength);
+	// Run the forward pass as another task, so that the two passes run in parallel.
+	auto fwd_pass = Executor::Get().Submit(Executor::CAPTURE, [&]() {
+		forward_pass(fwd_pixels, fwd_weight_sums, *this, weights, threshold, width, height, size, strength);
+	});
 
 	// Reverse pass, but otherwise the same as the forward pass. There could be a small
 	// saving in omitting it, but it's not huge given that they run in parallel.
@@ -248,7 +253,7 @@ HdrImage HdrImage::LpFilter(LpFilterConfig const &config) const
 		}
 	}
 
-	fwd_pass.join();
+	Executor::Get().Wait(fwd_pass);
 
 	// Combine.
 	unsigned int off = 0;
@@ -389,6 +394,8 @@ public:
 
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	void Teardown() override;
+
 private:
 	Stream *stream_;
 	StreamInfo info_;
@@ -460,6 +467,11 @@ void HdrStage::Configure()
 	acc_ = HdrImage(info_.width, info_.height, info_.width * info_.height * 3 / 2);
 	acc_.Clear();
 	lp_ = HdrImage(info_.width, info_.height, info_.width * info_.height);
+
+	memory_report_set("hdr accumulator", acc_.pixels.size() * sizeof(int16_t));
+	memory_report_set("hdr low pass image", lp_.pixels.size() * sizeof(int16_t));
+	// LpFilter's four double planes only exist while it runs, but it's the peak that matters.
+	memory_report_set("hdr low pass filter planes", 4 * info_.width * info_.height * sizeof(double));
 }
 
 bool HdrStage::Process(CompletedRequestPtr &completed_request)
@@ -474,7 +486,9 @@ bool HdrStage::Process(CompletedRequestPtr &completed_request)
 	if (frame_num_ >= config_.num_frames)
 		return false;
 
-	std::vector<libcamera::Span<uint8_t>> const &buffers = app_->Mmap(completed_request->buffers[stream_]);
+	// The final frame gets overwritten with the HDR result.
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	std::vector<libcamera::Span<uint8_t>> const &buffers = w.Get();
 	libcamera::Span<uint8_t> buffer = buffers[0];
 	uint8_t *image = buffer.data();
 
@@ -515,6 +529,15 @@ bool HdrStage::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
+void HdrStage::Teardown()
+{
+	acc_ = HdrImage();
+	lp_ = HdrImage();
+	memory_report_set("hdr accumulator", 0);
+	memory_report_set("hdr low pass image", 0);
+	memory_report_set("hdr low pass filter planes", 0);
+}
+
 static PostProcessingStage *Create(LibcameraApp *app)
 {
 	return new HdrStage(app);
@@ -22,6 +22,7 @@
 
 #include <libcamera/stream.h>
 
+#include "core/buffer_sync.hpp"
 #include "core/libcamera_app.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
@@ -133,7 +134,8 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 	if (config_.frame_period && completed_request->sequence % config_.frame_period)
 		return false;
 
-	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
+	BufferReadSync r(app_, completed_request->buffers[stream_], true);
+	libcamera::Span<uint8_t> buffer = r.Get()[0];
 	uint8_t *image = buffer.data();
 
 	// We need to protect access to first_time_, previous_frame_ and motion_detected_.
@@ -7,6 +7,7 @@
 
 #include "opencv2/imgproc.hpp"
 
+#include "core/buffer_sync.hpp"
 #include "core/libcamera_app.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
@@ -61,7 +62,8 @@ bool ObjectDetectDrawCvStage::Process(CompletedRequestPtr &completed_request)
 	if (!stream_)
 		return false;
 
-	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
 	uint32_t *ptr = (uint32_t *)buffer.data();
 	StreamInfo info = app_->GetStreamInfo(stream_);
 
@@ -7,6 +7,7 @@
 
 #include <libcamera/stream.h>
 
+#include "core/buffer_sync.hpp"
 #include "core/libcamera_app.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
@@ -58,7 +59,8 @@ void SobelCvStage::Configure()
 bool SobelCvStage::Process(CompletedRequestPtr &completed_request)
 {
 	StreamInfo info = app_->GetStreamInfo(stream_);
-	libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[stream_])[0];
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
 	uint8_t *ptr = (uint8_t *)buffer.data();
 
 	//Everything beyond this point is image processing...
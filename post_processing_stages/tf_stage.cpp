@@ -4,6 +4,8 @@
  *
  * tf_stage.hpp - base class for TensorFlowLite stages
  */
+#include "core/buffer_sync.hpp"
+
 #include "tf_stage.hpp"
 
 TfStage::TfStage(LibcameraApp *app, int tf_w, int tf_h) : PostProcessingStage(app), tf_w_(tf_w), tf_h_(tf_h)
@@ -44,6 +46,11 @@ void TfStage::initialise()
 	if (interpreter_->AllocateTensors() != kTfLiteOk)
 		throw std::runtime_error("TfStage: Failed to allocate tensors");
 
+	size_t tensor_bytes = 0;
+	for (size_t i = 0; i < interpreter_->tensors_size(); i++)
+		tensor_bytes += interpreter_->tensor(i)->bytes;
+	memory_report_set(std::string(Name()) + " tensors", tensor_bytes);
+
 	// Make an attempt to verify that the model expects this size of input.
 	int input = interpreter_->inputs()[0];
 	size_t size = interpreter_->tensor(input)->bytes;
@@ -102,15 +109,19 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 		if (config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0 &&
 			(!future_ || future_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
 		{
-			libcamera::Span<uint8_t> buffer = app_->Mmap(completed_request->buffers[lores_stream_])[0];
+			BufferReadSync r(app_, completed_request->buffers[lores_stream_]);
+			libcamera::Span<uint8_t> buffer = r.Get()[0];
 
-			// Copy the lores image here and let the asynchronous thread convert it to RGB.
+			// Copy the lores image here and let the asynchronous task convert it to RGB.
 			// Doing the "extra" copy is in fact hugely beneficial because it turns uncacned
 			// memory into cached memory, which is then *much* quicker.
+			size_t capacity = lores_copy_.capacity();
 			lores_copy_.assign(buffer.data(), buffer.data() + buffer.size());
+			if (lores_copy_.capacity() != capacity)
+				memory_report_set(std::string(Name()) + " lores copy", lores_copy_.capacity());
 
 			future_ = std::make_unique<std::future<void>>();
-			*future_ = std::async(std::launch::async, [this] {
+			*future_ = Executor::Get().Submit(Executor::ANALYTICS, [this] {
 				auto time_taken = ExecutionTime<std::micro>(&TfStage::runInference, this).count();
 
 				if (config_->verbose)
@@ -18,7 +18,9 @@
 #include "tensorflow/lite/interpreter.h"
 #include "tensorflow/lite/kernels/register.h"
 
+#include "core/executor.hpp"
 #include "core/libcamera_app.hpp"
+#include "core/memory_report.hpp"
 #include "core/stream_info.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
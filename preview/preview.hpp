@@ -35,6 +35,9 @@ public:
 	virtual void Reset() = 0;
 	// Check if preview window has been shut down.
 	virtual bool Quit() { return false; }
+	// Return whether Show() reads the pixels with the CPU, rather than handing the
+	// buffer to the GPU or display.
+	virtual bool CpuAccess() const { return false; }
 	// Return the maximum image size allowed.
 	virtual void MaxImageSize(unsigned int &w, unsigned int &h) const = 0;
 
@@ -0,0 +1,125 @@
+#!/usr/bin/python3
+#
+# libcamera-apps binary metadata file reader
+# Copyright (C) 2021, Raspberry Pi Ltd.
+#
+# Reads the files written by "libcamera-vid --save-metadata". The file is mmapped,
+# so records can be fetched at random without reading the whole thing. Can also be
+# imported and used as a module, e.g.
+#
+#   with MetadataFile('test.meta') as meta:
+#       print(meta.find_timestamp(1234567)['analogue_gain'])
+#
+import argparse
+import bisect
+import mmap
+import struct
+
+HEADER = struct.Struct('<8s5I36x')
+RECORD = struct.Struct('<Qq8f4I')
+ENTRY = struct.Struct('<32s2I6f')
+FIELDS = ('sequence', 'timestamp_us', 'exposure_time', 'analogue_gain', 'digital_gain', 'red_gain', 'blue_gain',
+          'lux', 'colour_temperature', 'focus', 'flags', 'num_entries', 'dropped_entries')
+ENTRY_TYPES = {1: 'scalar', 2: 'detection', 3: 'point', 4: 'classification'}
+ENTRY_SIZES = {1: 1, 2: 6, 3: 2, 4: 1}
+
+
+class MetadataFile:
+    def __init__(self, filename):
+        self.file = open(filename, 'rb')
+        self.map = mmap.mmap(self.file.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, version, self.header_size, self.record_size, self.entry_size, self.max_entries = \
+            HEADER.unpack_from(self.map, 0)
+        if magic.rstrip(b'\0') != b'LCMETA' or version != 1:
+            raise ValueError(filename + ' is not a version 1 metadata file')
+        # Ignore any partial record at the end (e.g. if the file is still being written).
+        self.count = (len(self.map) - self.header_size) // self.record_size
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def close(self):
+        self.map.close()
+        self.file.close()
+
+    def __len__(self):
+        return self.count
+
+    def _field(self, index, offset, fmt):
+        return struct.unpack_from(fmt, self.map, self.header_size + index * self.record_size + offset)[0]
+
+    def __getitem__(self, index):
+        if index < 0:
+            index += self.count
+        if not 0 <= index < self.count:
+            raise IndexError('metadata record index out of range')
+        offset = self.header_size + index * self.record_size
+        record = dict(zip(FIELDS, RECORD.unpack_from(self.map, offset)))
+        record['ae_locked'] = bool(record['flags'] & 1)
+        record['entries'] = []
+        offset += RECORD.size
+        for i in range(record['num_entries']):
+            key, type, item, *values = ENTRY.unpack_from(self.map, offset + i * self.entry_size)
+            record['entries'].append({'key': key.split(b'\0')[0].decode(errors='replace'),
+                                      'type': ENTRY_TYPES.get(type, type), 'index': item,
+                                      'value': values[:ENTRY_SIZES.get(type, 6)]})
+        return record
+
+    def _search(self, value, offset, fmt):
+        # Records are in order of sequence number and timestamp, so we can bisect.
+        keys = _Keys(self, offset, fmt)
+        i = bisect.bisect_left(keys, value)
+        if i < self.count and keys[i] == value:
+            return self[i]
+        return None
+
+    def find_sequence(self, sequence):
+        return self._search(sequence, 0, '<Q')
+
+    def find_timestamp(self, timestamp_us):
+        return self._search(timestamp_us, 8, '<q')
+
+
+class _Keys:
+    # Presents one field of every record as a sequence, without reading the others.
+    def __init__(self, meta, offset, fmt):
+        self.meta, self.offset, self.fmt = meta, offset, fmt
+
+    def __len__(self):
+        return len(self.meta)
+
+    def __getitem__(self, index):
+        return self.meta._field(index, self.offset, self.fmt)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='libcamera-apps metadata file reader')
+    parser.add_argument('filename', help='Metadata file generated by libcamera-vid --save-metadata', type=str)
+    parser.add_argument('--sequence', help='Show only the frame with this sequence number', type=int)
+    parser.add_argument('--timestamp', help='Show only the frame with this timestamp (us)', type=int)
+    args = parser.parse_args()
+
+    with MetadataFile(args.filename) as meta:
+        if args.sequence is not None:
+            records = [meta.find_sequence(args.sequence)]
+        elif args.timestamp is not None:
+            records = [meta.find_timestamp(args.timestamp)]
+        else:
+            records = (meta[i] for i in range(len(meta)))
+        for record in records:
+            if record is None:
+                print('Frame not found')
+                continue
+            print(f"#{record['sequence']} {record['timestamp_us']} us: exposure {record['exposure_time']:.0f} "
+                  f"ag {record['analogue_gain']:.2f} dg {record['digital_gain']:.2f} "
+                  f"gains {record['red_gain']:.2f},{record['blue_gain']:.2f} lux {record['lux']:.1f} "
+                  f"ct {record['colour_temperature']:.0f} focus {record['focus']:.0f}"
+                  f"{' (AE locked)' if record['ae_locked'] else ''}")
+            for entry in record['entries']:
+                print(f"    {entry['key']}[{entry['index']}] {entry['type']}:",
+                      ', '.join(f'{v:.2f}' for v in entry['value']))
+            if record['dropped_entries']:
+                print(f"    ({record['dropped_entries']} more entries didn't fit)")
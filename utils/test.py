@@ -13,12 +13,19 @@
 
 import argparse
 import json
+import math
 import os
 import os.path
+import re
+import socket
 import subprocess
 import sys
+import threading
+import time
 from timeit import default_timer as timer
 
+import metadata_reader
+
 
 class TestFailure(Exception):
     def __init__(self, message):
@@ -31,7 +38,8 @@ def check_exists(file, preamble):
         raise TestFailure(preamble + ": " + file + " not found")
 
 
-def clean_dir(dir, exts=('.jpg', '.png', '.bmp', '.dng', '.h264', '.mjpeg', '.raw', 'log.txt')):
+def clean_dir(dir, exts=('.jpg', '.png', '.bmp', '.dng', '.h264', '.mjpeg', '.fwht', '.raw', '.yuv', '.meta',
+                          'log.txt')):
     for file in os.listdir(dir):
         if file.endswith(exts):
             os.remove(os.path.join(dir, file))
@@ -170,9 +178,116 @@ def test_still(exe_dir, output_dir):
     if os.path.isfile(os.path.join(output_dir, 'test002.jpg')):
                raise("test_still: timelapse test, unexpected output file")
 
+    # "bracket test". Capture a -2, 0, +2 EV bracket in one still session.
+    print("    bracket test")
+    retcode, time_taken = run_executable(
+        [executable, '-t', '1000', '--bracket', '-2,0,2', '-o', output_jpg], logfile)
+    check_retcode(retcode, "test_still: bracket test")
+    check_time(time_taken, 1.2, 10, "test_still: bracket test")
+    for i in range(3):
+        check_size(os.path.join(output_dir, 'test_' + str(i) + '.jpg'), 1024, "test_still: bracket test")
+
+    # "bracket exposure test". Each saved bracket frame must have been exposed as that bracket asked.
+    print("    bracket exposure test")
+    retcode, time_taken = run_executable(
+        [executable, '-t', '1000', '-v', '--bracket', '-1,0,1', '-o', output_jpg], logfile)
+    check_retcode(retcode, "test_still: bracket exposure test")
+    log = open(logfile).read()
+    wanted = {int(i): (float(e), float(g)) for i, e, g in
+              re.findall(r'Bracket (\d+): EV \S+ exposure (\d+) gain ([\d.]+)', log)}
+    got = {int(i): (float(e), float(g)) for i, e, g in
+           re.findall(r'Bracket image (\d+): exposure (\d+) gain ([\d.]+)', log)}
+    if len(wanted) != 3 or sorted(got) != sorted(wanted):
+        raise TestFailure("test_still: bracket exposure test - missing bracket frames")
+    for i, (exposure, gain) in got.items():
+        if abs(exposure - wanted[i][0]) > 0.05 * wanted[i][0] or abs(gain - wanted[i][1]) > 0.05 * wanted[i][1]:
+            raise TestFailure("test_still: bracket exposure test - bracket " + str(i) + " exposed wrongly")
+
+    # "mapping speed test". Every stream's CPU read speed is measured, once per configuration,
+    # to decide whether read-only consumers should work from a cached copy.
+    print("    mapping speed test")
+    measured = re.findall(r'Stream (\S+): mapped reads \d+ MB/s', log)
+    if not measured or len(measured) != len(set(measured)):
+        raise TestFailure("test_still: mapping speed test - streams not measured exactly once")
+
+    # "server test". Keep the camera running and capture a couple of images over the socket.
+    print("    server test")
+    server_socket = os.path.join(output_dir, 'server.sock')
+    with open(logfile, 'w') as log:
+        # No timeout given: the server should keep going until told to quit.
+        p = subprocess.Popen([executable, '--server', server_socket], stdout=log, stderr=subprocess.STDOUT)
+        try:
+            for _ in range(50):
+                if os.path.exists(server_socket):
+                    break
+                time.sleep(0.1)
+            server_start = timer()
+            s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            s.connect(server_socket)
+            replies = s.makefile('r')
+            time.sleep(2)  # let AE/AWB settle
+            for name, controls in (('server0.jpg', {}), ('server1.jpg', {'ExposureTime': 10000})):
+                start_time = timer()
+                s.sendall((json.dumps({'filename': os.path.join(output_dir, name),
+                                       'controls': controls}) + '\n').encode())
+                reply = json.loads(replies.readline())
+                time_taken = timer() - start_time
+                if reply.get('status') != 'ok':
+                    raise TestFailure("test_still: server test failed, reply " + str(reply))
+                check_time(time_taken, 0, 2, "test_still: server test")
+                check_size(os.path.join(output_dir, name), 1024, "test_still: server test")
+            s.sendall((json.dumps({'encoding': 'png', 'filename': os.path.join(output_dir, 'bad.png')}) + '\n').encode())
+            if json.loads(replies.readline()).get('status') != 'error':
+                raise TestFailure("test_still: server test, incompatible encoding accepted")
+            # Two commands arriving together must each be captured with their own controls.
+            batch = [{'filename': os.path.join(output_dir, 'server' + str(i) + '.jpg'),
+                      'controls': {'ExposureTime': exposure, 'AnalogueGain': 1.0}}
+                     for i, exposure in ((2, 10000), (3, 20000))]
+            s.sendall(''.join(json.dumps(command) + '\n' for command in batch).encode())
+            for _ in batch:
+                if json.loads(replies.readline()).get('status') != 'ok':
+                    raise TestFailure("test_still: server test, batched capture failed")
+            check_jpeg_shutter(os.path.join(output_dir, 'server2.jpg'), '1/100', '100', "test_still: server test")
+            check_jpeg_shutter(os.path.join(output_dir, 'server3.jpg'), '1/50', '100', "test_still: server test")
+            # A client going away with a capture pending mustn't upset the server.
+            s2 = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            s2.connect(server_socket)
+            s2.sendall((json.dumps({'filename': os.path.join(output_dir, 'gone.jpg'),
+                                    'controls': {'ExposureTime': 30000}}) + '\n').encode())
+            s2.close()
+            time.sleep(max(0, 6 - (timer() - server_start)))  # outlive the default 5s timeout
+            if p.poll() is not None:
+                raise TestFailure("test_still: server test, server exited by itself")
+            s.sendall((json.dumps({'quit': True}) + '\n').encode())
+            if json.loads(replies.readline()).get('status') != 'ok':
+                raise TestFailure("test_still: server test, quit got a wrong reply")
+            s.close()
+            retcode = p.wait(timeout=10)
+        except Exception:
+            p.kill()
+            raise
+    check_retcode(retcode, "test_still: server test")
+
     print("libcamera-still tests passed")
 
 
+def check_jpeg_decodes(file, width, height, preamble):
+    # Decode the whole image, treating any corrupt data warnings (such as bad restart
+    # markers) as failures, and check its size.
+    try:
+        p = subprocess.Popen(['djpeg', '-strict', '-pnm', file], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        stdout, stderr = p.communicate()
+    except FileNotFoundError:
+        print("WARNING:", preamble, "- djpeg not found")
+        return
+    if p.returncode or stderr:
+        raise TestFailure(preamble + " - JPEG does not decode cleanly: " + stderr.decode(errors='replace'))
+    # The PNM header is the magic number, the width and height, and the maximum value.
+    fields = stdout.split(maxsplit=4)
+    if len(fields) < 4 or (int(fields[1]), int(fields[2])) != (width, height):
+        raise TestFailure(preamble + " - decoded JPEG has the wrong size")
+
+
 def check_jpeg_shutter(file, shutter_string, iso_string, preamble):
     # Verify that the expected shutter_string and iso_string are in the exif.
     try:
@@ -234,6 +349,20 @@ def test_jpeg(exe_dir, output_dir):
     check_size(output_shutter, 1024, "test_jpeg: shutter test")
     check_jpeg_shutter(output_shutter, '1/50', '100', "test_jpeg: shutter test")
 
+    # "carry exposure test". Start the still from the viewfinder's exposure; values
+    # fixed on the command line must still win.
+    print("    carry exposure test")
+    retcode, time_taken = run_executable(
+        [executable, '-t', '1000', '-o', output_jpg, '--carry-exposure'], logfile)
+    check_retcode(retcode, "test_jpeg: carry exposure test")
+    check_time(time_taken, 1.2, 8, "test_jpeg: carry exposure test")
+    check_size(output_jpg, 1024, "test_jpeg: carry exposure test")
+    retcode, time_taken = run_executable(
+        [executable, '-t', '1000', '-o', output_shutter, '--carry-exposure', '2',
+         '--shutter', '20000', '--gain', '1.0'], logfile)
+    check_retcode(retcode, "test_jpeg: carry exposure test")
+    check_jpeg_shutter(output_shutter, '1/50', '100', "test_jpeg: carry exposure test")
+
     print("libcamera-jpeg tests passed")
 
 
@@ -256,6 +385,38 @@ def check_timestamps(file, preamble):
         raise TestFailure(preamble + " - timestamps not increasing")
 
 
+def check_metadata(file, preamble):
+    try:
+        with metadata_reader.MetadataFile(file) as meta:
+            if len(meta) < 10:
+                raise TestFailure(preamble + " - too few metadata records")
+            records = [meta[i] for i in range(len(meta))]
+            if any(r1['sequence'] >= r2['sequence'] or r1['timestamp_us'] >= r2['timestamp_us']
+                   for r1, r2 in zip(records[:-1], records[1:])):
+                raise TestFailure(preamble + " - metadata records out of order")
+            if any(math.isnan(r['exposure_time']) or math.isnan(r['analogue_gain']) for r in records):
+                raise TestFailure(preamble + " - exposure missing from metadata")
+            middle = records[len(records) // 2]
+            found = meta.find_timestamp(middle['timestamp_us'])
+            if not found or found['sequence'] != middle['sequence']:
+                raise TestFailure(preamble + " - metadata lookup by timestamp failed")
+    except (OSError, ValueError) as e:
+        raise TestFailure(preamble + " - " + str(e))
+
+
+def read_drops(logfile, preamble):
+    # Parse the verbose "Frames lost: sensor N, no request N, ..." summary.
+    with open(logfile) as f:
+        lines = [line for line in f if line.startswith("Frames lost:")]
+    if not lines:
+        raise TestFailure(preamble + " - no frames lost summary")
+    drops = {}
+    for item in lines[-1][len("Frames lost:"):].split(','):
+        name, count = item.strip().rsplit(' ', 1)
+        drops[name] = int(count)
+    return drops
+
+
 def test_vid(exe_dir, output_dir):
     executable = os.path.join(exe_dir, 'libcamera-vid')
     output_h264 = os.path.join(output_dir, 'test.h264')
@@ -276,6 +437,17 @@ def test_vid(exe_dir, output_dir):
     check_time(time_taken, 2, 6, "test_vid: h264 test")
     check_size(output_h264, 1024, "test_vid: h264 test")
 
+    # "h264 keyframe test". Every frame is a keyframe at a high bitrate, so the encoded
+    # buffers must be big enough for the largest of them.
+    print("    h264 keyframe test")
+    retcode, time_taken = run_executable([executable, '-t', '3000', '-v', '--width', '1920', '--height', '1080',
+                                          '--intra', '1', '--bitrate', '25000000', '-o', output_h264],
+                                         logfile)
+    check_retcode(retcode, "test_vid: h264 keyframe test")
+    check_size(output_h264, 1024, "test_vid: h264 keyframe test")
+    if "encode errors" in open(logfile).read():
+        raise TestFailure("test_vid: h264 keyframe test - encoder lost frames")
+
     # "mjpeg test". As above, but write an mjpeg file.
     print("    mjpeg test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg',
@@ -285,6 +457,140 @@ def test_vid(exe_dir, output_dir):
     check_time(time_taken, 2, 6, "test_vid: mjpeg test")
     check_size(output_mjpeg, 1024, "test_vid: mjpeg test")
 
+    # "mjpeg threads test". As above, but encoding one frame at a time.
+    print("    mjpeg threads test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg', '--mjpeg-threads', '1',
+                                          '-o', output_mjpeg],
+                                         logfile)
+    check_retcode(retcode, "test_vid: mjpeg threads test")
+    check_time(time_taken, 2, 6, "test_vid: mjpeg threads test")
+    check_size(output_mjpeg, 1024, "test_vid: mjpeg threads test")
+
+    # "mjpeg bitrate test". With a bitrate, MJPEG should vary its quality to stay near it
+    # (unconstrained, this would be several times bigger).
+    print("    mjpeg bitrate test")
+    retcode, time_taken = run_executable([executable, '-t', '4000', '--codec', 'mjpeg', '--bitrate', '2000000',
+                                          '-o', output_mjpeg],
+                                         logfile)
+    check_retcode(retcode, "test_vid: mjpeg bitrate test")
+    check_size(output_mjpeg, 1024, "test_vid: mjpeg bitrate test")
+    if os.path.getsize(output_mjpeg) > 1.5 * 2000000 * 4 / 8:
+        raise TestFailure("test_vid: mjpeg bitrate test - output too big: " + str(os.path.getsize(output_mjpeg)))
+
+    # "mjpeg strips test". Encode each frame in strips, which are joined back into a single
+    # JPEG per frame.
+    print("    mjpeg strips test")
+    # 720 rows is 45 MCU rows, so the last strip is shorter than the others.
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg', '--mjpeg-strips', '4',
+                                          '--width', '1280', '--height', '720',
+                                          '--segment', '1', '-o', os.path.join(output_dir, 'test%03d.jpg')],
+                                         logfile)
+    check_retcode(retcode, "test_vid: mjpeg strips test")
+    check_time(time_taken, 2, 6, "test_vid: mjpeg strips test")
+    check_size(os.path.join(output_dir, 'test010.jpg'), 4100, "test_vid: mjpeg strips test")
+    check_jpeg_decodes(os.path.join(output_dir, 'test010.jpg'), 1280, 720, "test_vid: mjpeg strips test")
+
+    # "libav test". Encode with the libavcodec software encoder, if it was built in.
+    print("    libav test")
+    output_libav = os.path.join(output_dir, 'libav.h264')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'libav', '-o', output_libav],
+                                         logfile)
+    if "not built in" in open(logfile).read():
+        print("WARNING: libav encoder not built in - skipping libav tests")
+    else:
+        check_retcode(retcode, "test_vid: libav test")
+        check_time(time_taken, 2, 6, "test_vid: libav test")
+        check_size(output_libav, 1024, "test_vid: libav test")
+
+        # "libav throughput test". Compare how many 1080p frames per second the software
+        # H.264 encoder and MJPEG could each sustain on this machine. Each "Encode" line
+        # is from a thread working in parallel with the others, so their rates add up.
+        print("    libav throughput test")
+        for codec, output in (('libav', output_libav), ('mjpeg', output_mjpeg)):
+            retcode, time_taken = run_executable([executable, '-t', '4000', '-v', '-n', '--codec', codec,
+                                                  '--width', '1920', '--height', '1080', '-o', output],
+                                                 logfile)
+            check_retcode(retcode, "test_vid: libav throughput test")
+            times = re.findall(r"Encode \d+ frames, average time ([\d.]+)ms", open(logfile).read())
+            if not times:
+                raise TestFailure("test_vid: libav throughput test - no encode times for " + codec)
+            print("        " + codec + " could encode {:.1f} fps".format(sum(1000 / float(t) for t in times)))
+
+    # "fwht test". Drive the generic V4L2 encoder with the kernel's virtual FWHT codec. This
+    # needs "sudo modprobe vicodec" (with or without multiplanar=1).
+    print("    fwht test")
+    output_fwht = os.path.join(output_dir, 'test.fwht')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'fwht', '-o', output_fwht],
+                                         logfile)
+    if "failed to find a V4L2 FWHT encoder" in open(logfile).read():
+        print("WARNING: vicodec not loaded - skipping fwht tests")
+    else:
+        check_retcode(retcode, "test_vid: fwht test")
+        check_time(time_taken, 2, 6, "test_vid: fwht test")
+        check_size(output_fwht, 1024, "test_vid: fwht test")
+
+        # "fwht throughput test". Over a longer run the encoder should keep up with the camera,
+        # so (nearly) every frame gets encoded and none are lost.
+        print("    fwht throughput test")
+        retcode, time_taken = run_executable([executable, '-t', '20000', '-v', '-n', '--codec', 'fwht',
+                                              '--framerate', '30', '-o', output_fwht], logfile)
+        check_retcode(retcode, "test_vid: fwht throughput test")
+        match = re.search(r"V4L2Encoder closed after encoding (\d+) frames", open(logfile).read())
+        if not match:
+            raise TestFailure("test_vid: fwht throughput test - no frame count")
+        if int(match.group(1)) < 0.9 * 30 * 20:
+            raise TestFailure("test_vid: fwht throughput test - only " + match.group(1) + " frames encoded")
+        drops = read_drops(logfile, "test_vid: fwht throughput test")
+        if sum(drops.values()) > 2:
+            raise TestFailure("test_vid: fwht throughput test - unexpected drops " + str(drops))
+
+        # "fwht starvation test". At full HD the software codec falls behind and holds on to
+        # all the buffers. We should lose frames, not fail, and still stop promptly.
+        print("    fwht starvation test")
+        retcode, time_taken = run_executable([executable, '-t', '5000', '-v', '-n', '--codec', 'fwht',
+                                              '--width', '1920', '--height', '1080', '-o', output_fwht], logfile)
+        check_retcode(retcode, "test_vid: fwht starvation test")
+        check_size(output_fwht, 1024, "test_vid: fwht starvation test")
+        log = open(logfile).read()
+        match = re.search(r"Stopped in [\d.]+ms \(encoder ([\d.]+)ms\)", log)
+        if not match or float(match.group(1)) > 150:
+            raise TestFailure("test_vid: fwht starvation test - slow or missing stop")
+        if "V4L2Encoder closed" not in log:
+            raise TestFailure("test_vid: fwht starvation test - encoder did not close")
+
+        # "encoder queue test". With no queue, frames that arrive while the codec is busy are
+        # dropped straight away, and should be counted against the encoder.
+        print("    encoder queue test")
+        retcode, time_taken = run_executable([executable, '-t', '5000', '-v', '-n', '--codec', 'fwht',
+                                              '--width', '1920', '--height', '1080', '--encoder-queue', '0',
+                                              '--encoder-drop', 'newest', '-o', output_fwht], logfile)
+        check_retcode(retcode, "test_vid: encoder queue test")
+        check_size(output_fwht, 1024, "test_vid: encoder queue test")
+        drops = read_drops(logfile, "test_vid: encoder queue test")
+        log = open(logfile).read()
+        match = re.search(r"V4L2Encoder dropped (\d+) frames \(queue full\) and (\d+) frames", log)
+        if not match or int(match.group(1)) == 0:
+            raise TestFailure("test_vid: encoder queue test - no frames dropped")
+        # The camera may also have starved while the codec held its buffers, which counts
+        # against the encoder too, but only those losses are reported before it closes.
+        starved = re.findall(r"Lost (\d+) frame\(s\), cause: encoder", log[:match.start()])
+        expected = int(match.group(1)) + int(match.group(2)) + sum(int(n) for n in starved)
+        if drops['encoder'] != expected:
+            raise TestFailure("test_vid: encoder queue test - encoder drops miscounted " + str(drops) +
+                              ", expected " + str(expected))
+
+    # "yuv pack test". Packed images have no stride padding, so the file should hold a
+    # whole number of exactly 1000x600 frames (the stride here would be wider).
+    print("    yuv pack test")
+    output_yuv = os.path.join(output_dir, 'packed.yuv')
+    for pack in ('i420', 'nv12'):
+        retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'yuv420', '--yuv-pack', pack,
+                                              '--width', '1000', '--height', '600', '-o', output_yuv], logfile)
+        check_retcode(retcode, "test_vid: yuv pack test")
+        check_size(output_yuv, 1024, "test_vid: yuv pack test")
+        if os.path.getsize(output_yuv) % (1000 * 600 * 3 // 2):
+            raise TestFailure("test_vid: yuv pack test - " + pack + " output is not whole packed frames")
+
     # "segment test". As above, write the output in single frame segements.
     print("    segment test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg',
@@ -295,6 +601,52 @@ def test_vid(exe_dir, output_dir):
     # A bug in commit b20dc097621a trunctated each jpg to 4096 bytes, so check against 4100:
     check_size(os.path.join(output_dir, 'test035.jpg'), 4100, "test_vid: segment test")
 
+    # "keyframe request test". With an intra period longer than the whole recording, the
+    # segments can only start on time if the output asks the encoder for keyframes.
+    print("    keyframe request test")
+    retcode, time_taken = run_executable([executable, '-t', '5000', '--inline', '--intra', '1000',
+                                          '--segment', '1000', '-o', os.path.join(output_dir, 'seg%03d.h264')],
+                                         logfile)
+    check_retcode(retcode, "test_vid: keyframe request test")
+    for i in range(4):
+        check_size(os.path.join(output_dir, 'seg%03d.h264' % i), 1024, "test_vid: keyframe request test")
+
+    # "variable framerate keyframe test". With --framerate 0 the output must judge when the next
+    # segment is due from the frames themselves, and still only ask for a keyframe then.
+    print("    variable framerate keyframe test")
+    for f in os.listdir(output_dir):
+        if f.startswith('vfr') and f.endswith('.h264'):
+            os.remove(os.path.join(output_dir, f))
+    retcode, time_taken = run_executable([executable, '-t', '5000', '--inline', '--intra', '1000', '--framerate', '0',
+                                          '--segment', '1000', '-o', os.path.join(output_dir, 'vfr%03d.h264')],
+                                         logfile)
+    check_retcode(retcode, "test_vid: variable framerate keyframe test")
+    idr_frames = 0
+    for f in os.listdir(output_dir):
+        if f.startswith('vfr') and f.endswith('.h264'):
+            with open(os.path.join(output_dir, f), 'rb') as fp:
+                idr_frames += fp.read().count(b'\x00\x00\x01\x65')  # IDR slice NAL units
+    if idr_frames < 4 or idr_frames > 10:
+        raise TestFailure("test_vid: variable framerate keyframe test - " + str(idr_frames) + " IDR frames")
+
+    # "dual encode test". Record the main stream while also encoding the low resolution
+    # stream to a separate output.
+    print("    dual encode test")
+    for lores_codec in ('mjpeg', 'h264'):
+        output_lores = os.path.join(output_dir, 'lores.' + lores_codec)
+        retcode, time_taken = run_executable([executable, '-t', '3000', '-v', '--width', '1920', '--height', '1080',
+                                              '--lores-width', '640', '--lores-height', '480',
+                                              '--lores-codec', lores_codec, '--lores-bitrate', '1000000',
+                                              '--lores-output', output_lores, '-o', output_h264], logfile)
+        check_retcode(retcode, "test_vid: dual encode test")
+        check_size(output_h264, 1024, "test_vid: dual encode test")
+        if "Encoder stats (lores)" not in open(logfile).read():
+            raise TestFailure("test_vid: dual encode test - no lores encoder stats")
+        check_size(output_lores, 1024, "test_vid: dual encode test")
+        drops = read_drops(logfile, "test_vid: dual encode test")
+        if sum(drops.values()) > 2:
+            raise TestFailure("test_vid: dual encode test - unexpected drops " + str(drops) + " with " + lores_codec)
+
     # "circular test". Test circular buffer (really we should wait for it to wrap...)
     print("    circular test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '--inline', '--circular',
@@ -312,6 +664,15 @@ def test_vid(exe_dir, output_dir):
     if os.path.isfile(output_pause):
         raise TestFailure("test_vid: pause test - output file was not expected")
 
+    # "pause encode test". Nothing should be encoded while we start paused.
+    print("    pause encode test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-v', '--inline',
+                                          '--initial', 'pause', '-o', output_pause], logfile)
+    check_retcode(retcode, "test_vid: pause encode test")
+    log = open(logfile).read()
+    if "Encoding suspended" not in log or "Encoding resumed" in log:
+        raise TestFailure("test_vid: pause encode test - encoder not suspended")
+
     # "timestamp test". Check that the timestamp file is written and looks sensible.
     print("    timestamp test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
@@ -321,6 +682,153 @@ def test_vid(exe_dir, output_dir):
     check_size(output_h264, 1024, "test_vid: timestamp test")
     check_timestamps(output_timestamps, "test_vid: timestamp test")
 
+    # "drop accounting test". An ordinary recording shouldn't lose frames, and the
+    # summary should say so.
+    print("    drop accounting test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-v', '-o', output_h264], logfile)
+    check_retcode(retcode, "test_vid: drop accounting test")
+    drops = read_drops(logfile, "test_vid: drop accounting test")
+    if sum(drops.values()) > 2:
+        raise TestFailure("test_vid: drop accounting test - unexpected drops " + str(drops))
+
+    # "encoder stats test". The exit summary should have counted the frames, with sensible latencies.
+    print("    encoder stats test")
+    log = open(logfile).read()
+    match = re.search(r'Encoder stats \(video\): (\d+) frames, (\d+) keyframes', log)
+    if not match or int(match.group(1)) < 20 or int(match.group(2)) < 1:
+        raise TestFailure("test_vid: encoder stats test - missing or bad summary")
+    match = re.search(r'output latency: average ([\d.e+-]+)ms', log)
+    if not match or not 0 < float(match.group(1)) < 1000:
+        raise TestFailure("test_vid: encoder stats test - bad output latency")
+
+    # "slow output test". Drain the output slowly through a pipe. The unencoded frames
+    # are held until they're written, so the camera runs short and the lost frames
+    # should be blamed on the output, not the sensor.
+    print("    slow output test")
+    output_fifo = os.path.join(output_dir, 'slow.fifo')
+    if os.path.exists(output_fifo):
+        os.remove(output_fifo)
+    os.mkfifo(output_fifo)
+
+    def drain_slowly():
+        with open(output_fifo, 'rb') as f:
+            while f.read(1 << 16):
+                time.sleep(0.1)
+
+    drain_thread = threading.Thread(target=drain_slowly)
+    drain_thread.start()
+    retcode, time_taken = run_executable([executable, '-t', '3000', '-v', '--codec', 'yuv420',
+                                          '-o', output_fifo], logfile)
+    drain_thread.join()
+    os.remove(output_fifo)
+    check_retcode(retcode, "test_vid: slow output test")
+    drops = read_drops(logfile, "test_vid: slow output test")
+    if drops['output'] < 10 or drops['output'] < 4 * drops['sensor']:
+        raise TestFailure("test_vid: slow output test - drops misattributed " + str(drops))
+
+    # "mjpeg release test". MJPEG frames finish encoding out of order, but each camera buffer
+    # should go back as soon as its own frame is done, so the encoder shouldn't starve the camera.
+    print("    mjpeg release test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-v', '--codec', 'mjpeg',
+                                          '-o', output_mjpeg], logfile)
+    check_retcode(retcode, "test_vid: mjpeg release test")
+    drops = read_drops(logfile, "test_vid: mjpeg release test")
+    if drops.get('encoder', 0) > 2:
+        raise TestFailure("test_vid: mjpeg release test - encoder dropped " + str(drops['encoder']) + " frames")
+
+    # "shutdown test". Stopping the encoder shouldn't be held up waiting for threads to
+    # time out, whichever codec is in use. (Stopping the camera varies too much to time.)
+    print("    shutdown test")
+    for codec, ext in (('h264', '.h264'), ('mjpeg', '.mjpeg'), ('yuv420', '.yuv')):
+        retcode, time_taken = run_executable([executable, '-t', '2000', '-v', '--codec', codec,
+                                              '-o', os.path.join(output_dir, 'test' + ext)], logfile)
+        check_retcode(retcode, "test_vid: shutdown test")
+        match = re.search(r"Stopped in [\d.]+ms \(encoder ([\d.]+)ms\)", open(logfile).read())
+        if not match:
+            raise TestFailure("test_vid: shutdown test - no stop time for " + codec)
+        print("        " + codec + " stopped in " + match.group(1) + "ms")
+        if float(match.group(1)) > 150:
+            raise TestFailure("test_vid: shutdown test - " + codec + " took " + match.group(1) + "ms to stop")
+
+    # "metadata test". Check the binary metadata file has a sensible record for every frame.
+    print("    metadata test")
+    output_metadata = os.path.join(output_dir, 'test.meta')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--save-metadata', output_metadata], logfile)
+    check_retcode(retcode, "test_vid: metadata test")
+    check_metadata(output_metadata, "test_vid: metadata test")
+
+    # "control socket test". Change things while recording, and check bad commands get errors.
+    print("    control socket test")
+    control_socket = os.path.join(output_dir, 'control.sock')
+    with open(logfile, 'w') as log:
+        p = subprocess.Popen([executable, '-t', '0', '--control-socket', control_socket, '-o', output_h264],
+                             stdout=log, stderr=subprocess.STDOUT)
+        try:
+            for _ in range(50):
+                if os.path.exists(control_socket):
+                    break
+                time.sleep(0.1)
+            s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            s.connect(control_socket)
+            replies = s.makefile('r')
+            time.sleep(1)
+            for command, expected in (({'controls': {'ExposureTime': 10000, 'AnalogueGain': 2.0}}, 'ok'),
+                                      ({'roi': [0.25, 0.25, 0.5, 0.5]}, 'ok'),
+                                      ({'bitrate': 2000000, 'keyframe': True}, 'ok'),
+                                      ({'stats': 'lores'}, 'error'),
+                                      ({'stages': {'no_such_stage': False}}, 'error'),
+                                      ({'controls': {'NoSuchControl': 1}}, 'error')):
+                s.sendall((json.dumps(command) + '\n').encode())
+                reply = json.loads(replies.readline())
+                if reply.get('status') != expected:
+                    raise TestFailure("test_vid: control socket test, " + str(command) + " gave " + str(reply))
+                time.sleep(0.5)
+            s.sendall((json.dumps({'stats': True}) + '\n').encode())
+            stats = json.loads(replies.readline()).get('stats', {})
+            if int(stats.get('frames', 0)) < 10 or float(stats.get('bitrate', 0)) <= 0:
+                raise TestFailure("test_vid: control socket test, bad encoder stats " + str(stats))
+            s.sendall((json.dumps({'quit': True}) + '\n').encode())
+            replies.readline()
+            s.close()
+            retcode = p.wait(timeout=10)
+        except Exception:
+            p.kill()
+            raise
+    check_retcode(retcode, "test_vid: control socket test")
+    check_size(output_h264, 1024, "test_vid: control socket test")
+
+    # "memory report test". Check the startup and periodic memory reports appear, and
+    # that they account for the camera buffers.
+    print("    memory report test")
+    retcode, time_taken = run_executable([executable, '-t', '3000', '--memory-report', '1',
+                                          '-o', output_h264], logfile)
+    check_retcode(retcode, "test_vid: memory report test")
+    log = open(logfile).read()
+    for expected in ("Memory report (startup)", "Memory report (periodic)", "Memory report (exit)",
+                     "    dmabuf ", "    peak RSS: configure "):
+        if expected not in log:
+            raise TestFailure("test_vid: memory report test - missing \"" + expected.strip() + "\"")
+
+    # "allocation test". Once warmed up, the plain yuv420 and mjpeg recording paths shouldn't
+    # allocate any memory of their own per frame. Needs a build with ENABLE_ALLOC_AUDIT.
+    print("    allocation test")
+    for codec, ext in (('yuv420', '.yuv'), ('mjpeg', '.mjpeg')):
+        retcode, time_taken = run_executable([executable, '-t', '3000', '-n', '--codec', codec,
+                                              '--alloc-audit', '30', '-o', os.path.join(output_dir, 'test' + ext)],
+                                             logfile)
+        check_retcode(retcode, "test_vid: allocation test")
+        log = open(logfile).read()
+        if "not built in" in log:
+            print("WARNING: allocation audit not built in - skipping allocation test")
+            break
+        match = re.search(r"Steady-state allocations: app (\d+)", log)
+        if not match:
+            raise TestFailure("test_vid: allocation test - no allocation summary")
+        if int(match.group(1)) > 0:
+            raise TestFailure("test_vid: allocation test - " + match.group(1) + " steady-state allocations for " +
+                              codec)
+
     print("libcamera-vid tests passed")
 
 
@@ -360,6 +868,56 @@ def test_post_processing(exe_dir, output_dir, json_dir):
     check_retcode(retcode, "test_post_processing: negate test")
     check_time(time_taken, 2, 8, "test_post_processing: negate test")
 
+    # "reload test". Change the post-processing file while running, and check the new
+    # stages get swapped in without the camera stopping.
+    print("    reload test")
+    reload_file = os.path.join(output_dir, 'reload.json')
+    with open(json_file) as f:
+        negate = f.read()
+    with open(reload_file, 'w') as f:
+        f.write(negate)
+    with open(logfile, 'w') as log:
+        p = subprocess.Popen([executable, '-t', '4000', '--post-process-file', reload_file,
+                              '--post-process-reload'], stdout=log, stderr=subprocess.STDOUT)
+        try:
+            time.sleep(1.5)
+            with open(reload_file, 'w') as f:
+                f.write('{}')
+            time.sleep(1)
+            with open(reload_file, 'w') as f:
+                f.write(negate)
+            retcode = p.wait(timeout=10)
+        except Exception:
+            p.kill()
+            raise
+    check_retcode(retcode, "test_post_processing: reload test")
+    if open(logfile, 'r').read().count('Post-processing file reloaded') != 2:
+        raise TestFailure("test_post_processing: reload test - post-processing file not reloaded twice")
+
+    # "motion gate test". Only encode while the motion detector sees motion. The scene
+    # probably isn't moving, so we expect encoding to be suspended.
+    print("    motion gate test")
+    executable = os.path.join(exe_dir, 'libcamera-vid')
+    check_exists(executable, 'post-processing')
+    json_file = os.path.join(json_dir, 'motion_detect.json')
+    check_exists(json_file, 'post-processing')
+    retcode, time_taken = run_executable([executable, '-t', '3000', '-v', '--lores-width', '128',
+                                          '--lores-height', '96', '--encode-gate', 'motion_detect.result',
+                                          '--post-process-file', json_file,
+                                          '--save-pts', os.path.join(output_dir, 'motion.pts'),
+                                          '-o', os.path.join(output_dir, 'motion.h264')],
+                                         logfile)
+    check_retcode(retcode, "test_post_processing: motion gate test")
+    log = open(logfile, 'r').read()
+    if "Encoding suspended" not in log or "WARNING: no motion_detect.result" in log:
+        raise TestFailure("test_post_processing: motion gate test - encoding was not gated")
+    # If encoding resumed, the output must have restarted on a keyframe, which closes up
+    # the timestamps across the gap.
+    with open(os.path.join(output_dir, 'motion.pts')) as f:
+        timestamps = [float(line) for line in f if not line.startswith('#')]
+    if any(t2 - t1 > 500 for t1, t2 in zip(timestamps, timestamps[1:])):
+        raise TestFailure("test_post_processing: motion gate test - output did not restart after a gap")
+
     # "hdr test". Take an HDR capture.
     print("    hdr test")
     executable = os.path.join(exe_dir, 'libcamera-still')